@@ -57,15 +57,26 @@
 
 #include "getoptions.h"
 #include <cilk/cilk.h>
+#include <cilk/cilk_api.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #ifdef SERIAL
 #include <cilk/cilk_stub.h>
 #endif
 
+#if (defined(__AVX2__) || defined(__AVX512F__)) && !defined(NOSIMD)
+#include <immintrin.h>
+#endif
+
 unsigned long long todval(struct timeval *tp) {
   return tp->tv_sec * 1000 * 1000 + tp->tv_usec;
 }
@@ -74,7 +85,17 @@ unsigned long long todval(struct timeval *tp) {
 #define RAND_MAX 32767
 #endif
 
+/* compile with -DELM32 to sort 32-bit keys instead of 64-bit ones */
+#ifdef ELM32
+typedef int ELM;
+#define ELM_BITS 32
+#else
 typedef long ELM;
+#define ELM_BITS 64
+#endif
+
+#define INPUT_ELM ELM
+#include "randinput.h"
 
 /* MERGESIZE must be >= 2 */
 #define KILO 1024
@@ -82,16 +103,6 @@ typedef long ELM;
 #define QUICKSIZE (2 * KILO)
 #define INSERTIONSIZE 20
 
-static unsigned long rand_nxt = 0;
-
-static inline unsigned long my_rand(void) {
-
-  rand_nxt = rand_nxt * 1103515245 + 12345;
-  return rand_nxt;
-}
-
-static inline void my_srand(unsigned long seed) { rand_nxt = seed; }
-
 static inline ELM med3(ELM a, ELM b, ELM c) {
 
   if (a < b) {
@@ -198,8 +209,268 @@ void seqquick(ELM *low, ELM *high) {
   insertion_sort(low, high);
 }
 
+/*
+ * SIMD leaf kernels.
+ *
+ * When the compiler targets AVX2 or AVX-512 (e.g., EXTRA_CFLAGS=-march=native)
+ * the sequential merge at the bottom of cilkmerge and the sequential sort at
+ * the bottom of cilksort use bitonic networks on vector registers holding
+ * VLANES keys.  The merge is the streaming merge of Inoue et al.: keep the
+ * VLANES largest keys seen so far in a register, merge them with the next
+ * vector from whichever input has the smaller head, and emit the VLANES
+ * smallest.  Define NOSIMD to get the scalar code.
+ *
+ * Every network below is built from one primitive, v_cmpx(v, d, m), which
+ * compare-exchanges lane i with lane i^d and leaves the maximum in the
+ * lanes selected by m.
+ */
+#if defined(__AVX512F__) && !defined(NOSIMD)
+#define CILKSORT_SIMD
+#define LEAF_KERNELS "avx512"
+typedef __m512i vec_t;
+#if ELM_BITS == 64
+#define VLANES 8
+typedef __mmask8 vmask_t;
+static inline vec_t v_iota(void) {
+  return _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+}
+static inline vec_t v_min(vec_t a, vec_t b) { return _mm512_min_epi64(a, b); }
+static inline vec_t v_max(vec_t a, vec_t b) { return _mm512_max_epi64(a, b); }
+static inline vec_t v_xorperm(vec_t v, int d) {
+  return _mm512_permutexvar_epi64(
+      _mm512_xor_si512(v_iota(), _mm512_set1_epi64(d)), v);
+}
+static inline vmask_t v_bit(int d) {
+  return _mm512_test_epi64_mask(v_iota(), _mm512_set1_epi64(d));
+}
+static inline vec_t v_select(vmask_t m, vec_t a, vec_t b) {
+  return _mm512_mask_blend_epi64(m, a, b);
+}
+#else
+#define VLANES 16
+typedef __mmask16 vmask_t;
+static inline vec_t v_iota(void) {
+  return _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+                           15);
+}
+static inline vec_t v_min(vec_t a, vec_t b) { return _mm512_min_epi32(a, b); }
+static inline vec_t v_max(vec_t a, vec_t b) { return _mm512_max_epi32(a, b); }
+static inline vec_t v_xorperm(vec_t v, int d) {
+  return _mm512_permutexvar_epi32(
+      _mm512_xor_si512(v_iota(), _mm512_set1_epi32(d)), v);
+}
+static inline vmask_t v_bit(int d) {
+  return _mm512_test_epi32_mask(v_iota(), _mm512_set1_epi32(d));
+}
+static inline vec_t v_select(vmask_t m, vec_t a, vec_t b) {
+  return _mm512_mask_blend_epi32(m, a, b);
+}
+#endif
+static inline vmask_t v_mxor(vmask_t a, vmask_t b) { return a ^ b; }
+static inline vec_t v_load(const ELM *p) { return _mm512_loadu_si512(p); }
+static inline void v_store(ELM *p, vec_t v) { _mm512_storeu_si512(p, v); }
+
+#elif defined(__AVX2__) && !defined(NOSIMD)
+#define CILKSORT_SIMD
+#define LEAF_KERNELS "avx2"
+typedef __m256i vec_t;
+typedef __m256i vmask_t;
+static inline vec_t v_iota32(void) {
+  return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+}
+#if ELM_BITS == 64
+#define VLANES 4
+static inline vec_t v_min(vec_t a, vec_t b) {
+  return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+}
+static inline vec_t v_max(vec_t a, vec_t b) {
+  return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b));
+}
+/* a 64-bit lane is a pair of 32-bit lanes, so flip the pair index */
+static inline vec_t v_xorperm(vec_t v, int d) {
+  return _mm256_permutevar8x32_epi32(
+      v, _mm256_xor_si256(v_iota32(), _mm256_set1_epi32(2 * d)));
+}
+static inline vmask_t v_bit(int d) {
+  vec_t bits = _mm256_and_si256(_mm256_setr_epi64x(0, 1, 2, 3),
+                                _mm256_set1_epi64x(d));
+  return _mm256_cmpgt_epi64(bits, _mm256_setzero_si256());
+}
+#else
+#define VLANES 8
+static inline vec_t v_min(vec_t a, vec_t b) { return _mm256_min_epi32(a, b); }
+static inline vec_t v_max(vec_t a, vec_t b) { return _mm256_max_epi32(a, b); }
+static inline vec_t v_xorperm(vec_t v, int d) {
+  return _mm256_permutevar8x32_epi32(
+      v, _mm256_xor_si256(v_iota32(), _mm256_set1_epi32(d)));
+}
+static inline vmask_t v_bit(int d) {
+  vec_t bits = _mm256_and_si256(v_iota32(), _mm256_set1_epi32(d));
+  return _mm256_cmpgt_epi32(bits, _mm256_setzero_si256());
+}
+#endif
+static inline vmask_t v_mxor(vmask_t a, vmask_t b) {
+  return _mm256_xor_si256(a, b);
+}
+static inline vec_t v_select(vmask_t m, vec_t a, vec_t b) {
+  return _mm256_blendv_epi8(a, b, m);
+}
+static inline vec_t v_load(const ELM *p) {
+  return _mm256_loadu_si256((const __m256i *)p);
+}
+static inline void v_store(ELM *p, vec_t v) {
+  _mm256_storeu_si256((__m256i *)p, v);
+}
+#endif
+
+#ifdef CILKSORT_SIMD
+
+static inline vec_t v_cmpx(vec_t v, int d, vmask_t m) {
+  vec_t t = v_xorperm(v, d);
+  return v_select(m, v_min(v, t), v_max(v, t));
+}
+
+/* sort a bitonic vector into ascending order */
+static inline vec_t v_bitonic_clean(vec_t v) {
+  for (int d = VLANES / 2; d > 0; d >>= 1)
+    v = v_cmpx(v, d, v_bit(d));
+  return v;
+}
+
+/* full bitonic sort of one vector; v_bit(VLANES) selects no lane */
+static inline vec_t v_sort(vec_t v) {
+  for (int k = 2; k <= VLANES; k <<= 1)
+    for (int d = k / 2; d > 0; d >>= 1)
+      v = v_cmpx(v, d, v_mxor(v_bit(d), v_bit(k)));
+  return v;
+}
+
+/*
+ * *lo and *hi are sorted; on return *lo holds the VLANES smallest keys
+ * of the two and *hi the VLANES largest, both sorted.
+ */
+static inline void v_merge2(vec_t *lo, vec_t *hi) {
+  vec_t b = v_xorperm(*hi, VLANES - 1); /* reverse */
+  vec_t l = v_min(*lo, b);
+  vec_t h = v_max(*lo, b);
+  *lo = v_bitonic_clean(l);
+  *hi = v_bitonic_clean(h);
+}
+
+/* merge the half-open ranges [a, ea) and [b, eb) into dest */
+static void scalar_merge(const ELM *a, const ELM *ea, const ELM *b,
+                         const ELM *eb, ELM *dest) {
+
+  while (a < ea && b < eb) {
+    int tb = *b < *a;
+    *dest++ = tb ? *b : *a;
+    a += !tb;
+    b += tb;
+  }
+  if (a < ea)
+    memcpy(dest, a, sizeof(ELM) * (ea - a));
+  else
+    memcpy(dest, b, sizeof(ELM) * (eb - b));
+}
+
+static void simd_merge(const ELM *a, long na, const ELM *b, long nb,
+                       ELM *dest) {
+
+  const ELM *ea = a + na, *eb = b + nb;
+  ELM buf[VLANES], mid[2 * VLANES];
+  vec_t lo, hi;
+
+  if (na < VLANES || nb < VLANES) {
+    scalar_merge(a, ea, b, eb, dest);
+    return;
+  }
+
+  lo = v_load(a);
+  hi = v_load(b);
+  a += VLANES;
+  b += VLANES;
+
+  /*
+   * Every key in hi came from an already-loaded vector, so all of them
+   * are <= the smaller of the two heads; hi plus the next vector of the
+   * input with the smaller head therefore contains the VLANES smallest
+   * remaining keys.
+   */
+  for (;;) {
+    v_merge2(&lo, &hi);
+    v_store(dest, lo);
+    dest += VLANES;
+    if (a < ea && (b >= eb || *a <= *b)) {
+      if (ea - a < VLANES)
+        break;
+      lo = v_load(a);
+      a += VLANES;
+    } else if (b < eb) {
+      if (eb - b < VLANES)
+        break;
+      lo = v_load(b);
+      b += VLANES;
+    } else {
+      break;
+    }
+  }
+
+  /*
+   * Fewer than VLANES keys remain in the input with the smaller head:
+   * fold them into the register contents, then finish against the other
+   * input.
+   */
+  v_store(buf, hi);
+  if (a < ea && (b >= eb || *a <= *b)) {
+    scalar_merge(buf, buf + VLANES, a, ea, mid);
+    scalar_merge(mid, mid + VLANES + (ea - a), b, eb, dest);
+  } else {
+    scalar_merge(buf, buf + VLANES, b, eb, mid);
+    scalar_merge(mid, mid + VLANES + (eb - b), a, ea, dest);
+  }
+}
+
+/*
+ * Sort low[0..size) using tmp[0..size) as scratch: sort each vector in
+ * registers, then merge runs bottom-up, alternating between the buffers.
+ */
+static void simd_sort(ELM *low, ELM *tmp, long size) {
+
+  long full = size - size % VLANES;
+  ELM *src = low, *dst = tmp, *t;
+
+  for (long i = 0; i < full; i += VLANES)
+    v_store(low + i, v_sort(v_load(low + i)));
+  insertion_sort(low + full, low + size - 1);
+
+  for (long w = VLANES; w < size; w *= 2) {
+    for (long i = 0; i < size; i += 2 * w) {
+      long na = (size - i < w) ? size - i : w;
+      long nb = (size - i - na < w) ? size - i - na : w;
+      if (nb == 0)
+        memcpy(dst + i, src + i, sizeof(ELM) * na);
+      else
+        simd_merge(src + i, na, src + i + na, nb, dst + i);
+    }
+    t = src;
+    src = dst;
+    dst = t;
+  }
+
+  if (src != low)
+    memcpy(low, src, sizeof(ELM) * size);
+}
+
+#else
+#define LEAF_KERNELS "scalar"
+#endif
+
 void seqmerge(ELM *low1, ELM *high1, ELM *low2, ELM *high2, ELM *lowdest) {
 
+#ifdef CILKSORT_SIMD
+  simd_merge(low1, high1 - low1 + 1, low2, high2 - low2 + 1, lowdest);
+#else
+
   ELM a1, a2;
 
   /*
@@ -269,6 +540,7 @@ void seqmerge(ELM *low1, ELM *high1, ELM *low2, ELM *high2, ELM *lowdest) {
   } else {
     memcpy(lowdest, low1, sizeof(ELM) * (high1 - low1 + 1));
   }
+#endif
 }
 
 #define swap_indices(a, b)                                                     \
@@ -379,7 +651,11 @@ void cilksort(ELM *low, ELM *tmp, long size) {
 
   if (size < QUICKSIZE) {
     /* quicksort when less than 1024 elements */
+#ifdef CILKSORT_SIMD
+    simd_sort(low, tmp, size);
+#else
     seqquick(low, low + size - 1);
+#endif
     return;
   }
 
@@ -408,36 +684,1174 @@ void cilksort(ELM *low, ELM *tmp, long size) {
   return;
 }
 
-void scramble_array(ELM *arr, unsigned long size) {
+/*
+ * samplesort: a variant of cilksort for inputs much larger than cache.
+ *
+ *   1) sort a sample of the input and pick nbuckets - 1 splitters
+ *   2) for each block of the input (in parallel), count how many elements
+ *      fall into each bucket
+ *   3) prefix-sum the counts and scatter every block into tmp (in parallel)
+ *   4) cilksort each bucket (in parallel) and copy it back into place
+ *
+ * The whole array is read twice and written twice; the buckets are sized
+ * to be sorted largely in cache.  cilksort, in contrast, makes log_4(n)
+ * passes over all of memory.
+ */
+#define SAMPLE_OVERSUB 8                /* buckets per worker */
+#define SAMPLE_OVERSAMPLE 32            /* sampled elements per bucket */
+#define SAMPLE_BUCKETSIZE (64 * KILO)   /* target elements per bucket */
+#define SAMPLE_MAXBUCKETS (4 * KILO)
+#define SAMPLE_BLOCKSIZE (256 * KILO)   /* elements per counting block */
+
+/*
+ * splitters are kept as an implicit binary search tree (tree[1] is the
+ * root), so finding the bucket of val takes logb branch-free steps
+ */
+static inline long classify(const ELM *tree, int logb, ELM val) {
+
+  long j = 1;
+
+  for (int l = 0; l < logb; l++)
+    j = 2 * j + (tree[j] < val);
+
+  return j - (1L << logb);
+}
+
+static void build_tree(ELM *tree, const ELM *splitters, long node, long lo,
+                       long hi) {
+
+  long mid = (lo + hi) / 2;
+
+  if (lo >= hi)
+    return;
+  tree[node] = splitters[mid];
+  build_tree(tree, splitters, 2 * node, lo, mid);
+  build_tree(tree, splitters, 2 * node + 1, mid + 1, hi);
+}
+
+void samplesort(ELM *low, ELM *tmp, long size) {
+
+  long nbuckets, nblocks, nsample, blocksize;
+  int logb;
+  ELM *sample, *tree;
+  long *counts;
+
+  nbuckets = (long)__cilkrts_get_nworkers() * SAMPLE_OVERSUB;
+  if (nbuckets < size / SAMPLE_BUCKETSIZE)
+    nbuckets = size / SAMPLE_BUCKETSIZE;
+  if (nbuckets > SAMPLE_MAXBUCKETS)
+    nbuckets = SAMPLE_MAXBUCKETS;
+  for (logb = 0; (1L << logb) < nbuckets; logb++)
+    ;
+  nbuckets = 1L << logb;
+
+  if (size < nbuckets * SAMPLE_OVERSAMPLE || size < QUICKSIZE * nbuckets) {
+    cilksort(low, tmp, size);
+    return;
+  }
+
+  /* 1) sample with a fixed-seed hash of the index, and pick splitters */
+  nsample = nbuckets * SAMPLE_OVERSAMPLE;
+  sample = (ELM *)malloc(nsample * sizeof(ELM));
+  tree = (ELM *)malloc(nbuckets * sizeof(ELM));
+  for (long i = 0; i < nsample; i++) {
+    unsigned long h = (i + 1) * 0x9e3779b97f4a7c15UL;
+    h ^= h >> 29;
+    sample[i] = low[h % size];
+  }
+  seqquick(sample, sample + nsample - 1);
+  for (long i = 1; i < nbuckets; i++)
+    sample[i - 1] = sample[i * SAMPLE_OVERSAMPLE];
+  build_tree(tree, sample, 1, 0, nbuckets - 1);
+  free(sample);
+
+  /* 2) per-block bucket counts; counts[b * nblocks + k] for block k */
+  blocksize = SAMPLE_BLOCKSIZE;
+  if (blocksize * __cilkrts_get_nworkers() * 4 > size)
+    blocksize = size / (__cilkrts_get_nworkers() * 4) + 1;
+  nblocks = (size + blocksize - 1) / blocksize;
+  counts = (long *)calloc(nbuckets * nblocks, sizeof(long));
+
+  cilk_for (long k = 0; k < nblocks; k++) {
+    long end = (k + 1) * blocksize < size ? (k + 1) * blocksize : size;
+    for (long i = k * blocksize; i < end; i++)
+      counts[classify(tree, logb, low[i]) * nblocks + k]++;
+  }
+
+  /* 3) exclusive prefix sum, bucket-major, then scatter into tmp */
+  long total = 0;
+  for (long i = 0; i < nbuckets * nblocks; i++) {
+    long c = counts[i];
+    counts[i] = total;
+    total += c;
+  }
+
+  cilk_for (long k = 0; k < nblocks; k++) {
+    long end = (k + 1) * blocksize < size ? (k + 1) * blocksize : size;
+    for (long i = k * blocksize; i < end; i++) {
+      ELM val = low[i];
+      tmp[counts[classify(tree, logb, val) * nblocks + k]++] = val;
+    }
+  }
+
+  /*
+   * 4) after the scatter, the last block's cursor for bucket b points
+   * one past the end of bucket b
+   */
+  cilk_for (long b = 0; b < nbuckets; b++) {
+    long end = counts[b * nblocks + nblocks - 1];
+    long start = b == 0 ? 0 : counts[(b - 1) * nblocks + nblocks - 1];
+    cilksort(tmp + start, low + start, end - start);
+    memcpy(low + start, tmp + start, (end - start) * sizeof(ELM));
+  }
+
+  free(counts);
+  free(tree);
+}
+
+/*
+ * adaptivesort: a natural mergesort that exploits presorted input.
+ *
+ * The array is cut into blocks that are scanned in parallel for maximal
+ * ascending or strictly descending runs; descending runs are reversed in
+ * place, and runs shorter than MINRUN are extended to MINRUN keys and
+ * sorted, as in TimSort.  Adjacent runs that are already in order are
+ * coalesced, and the remaining runs are merged pairwise by a balanced
+ * tree of cilkmerges.  An input made of r runs thus takes O(n log r) work,
+ * and sorted or reverse-sorted input takes O(n).
+ */
+#define MINRUN QUICKSIZE
+#define RUNBLOCK (256 * KILO)
+
+/* sort low[0..size) the way the leaves of cilksort do */
+static void leafsort(ELM *low, ELM *tmp, long size) {
+
+#ifdef CILKSORT_SIMD
+  simd_sort(low, tmp, size);
+#else
+  seqquick(low, low + size - 1);
+#endif
+}
+
+static void reverse(ELM *low, long size) {
+
+  cilk_for (long i = 0; i < size / 2; i++) {
+    ELM t = low[i];
+    low[i] = low[size - 1 - i];
+    low[size - 1 - i] = t;
+  }
+}
+
+/*
+ * Split low[0..size) into sorted runs of at least MINRUN keys (except at
+ * the end), sorting it as needed.  Writes the run starts to bounds and
+ * returns their number.
+ */
+static long find_runs(ELM *low, ELM *tmp, long size, long *bounds) {
 
-  unsigned long i;
-  unsigned long j;
+  long nruns = 0;
 
-  for (i = 0; i < size; ++i) {
-    j = my_rand();
-    j = j % size;
-    swap(arr[i], arr[j]);
+  for (long i = 0; i < size;) {
+    long j = i + 1;
+    if (j < size && low[j] < low[i]) {
+      while (j < size && low[j] < low[j - 1])
+        j++;
+      reverse(low + i, j - i);
+    } else {
+      while (j < size && low[j] >= low[j - 1])
+        j++;
+    }
+    if (j - i < MINRUN) {
+      j = i + MINRUN < size ? i + MINRUN : size;
+      leafsort(low + i, tmp + i, j - i);
+    }
+    bounds[nruns++] = i;
+    i = j;
   }
+
+  return nruns;
 }
 
-void fill_array(ELM *arr, unsigned long size) {
+/*
+ * Merge runs lo..hi-1 of a, where run r is [bounds[r], bounds[r + 1]).
+ * The result goes to b if to_b is set and to a otherwise.
+ */
+static void merge_runs(ELM *a, ELM *b, const long *bounds, long lo, long hi,
+                       int to_b) {
+
+  long mid = (lo + hi) / 2;
+  ELM *src = to_b ? a : b;
+  ELM *dst = to_b ? b : a;
 
-  unsigned long i;
+  if (hi - lo == 1) {
+    if (to_b)
+      memcpy(b + bounds[lo], a + bounds[lo],
+             (bounds[hi] - bounds[lo]) * sizeof(ELM));
+    return;
+  }
 
-  my_srand(1);
-  /* first, fill with integers 1..size */
-  for (i = 0; i < size; ++i) {
-    arr[i] = i;
+  cilk_scope {
+    cilk_spawn merge_runs(a, b, bounds, lo, mid, !to_b);
+    merge_runs(a, b, bounds, mid, hi, !to_b);
   }
 
-  /* then, scramble randomly */
-  scramble_array(arr, size);
+  if (src[bounds[mid] - 1] <= src[bounds[mid]])
+    memcpy(dst + bounds[lo], src + bounds[lo],
+           (bounds[hi] - bounds[lo]) * sizeof(ELM));
+  else
+    cilkmerge(src + bounds[lo], src + bounds[mid] - 1, src + bounds[mid],
+              src + bounds[hi] - 1, dst + bounds[lo]);
+}
+
+void adaptivesort(ELM *low, ELM *tmp, long size) {
+
+  long nblocks = (size + RUNBLOCK - 1) / RUNBLOCK;
+  long maxruns = RUNBLOCK / MINRUN + 1;
+  long *bounds, *nruns, total;
+  int *desc;
+
+  if (size < 2)
+    return;
+
+  /* a globally descending input is reversed as a whole */
+  desc = (int *)malloc(nblocks * sizeof(int));
+  cilk_for (long k = 0; k < nblocks; k++) {
+    long end = (k + 1) * RUNBLOCK < size ? (k + 1) * RUNBLOCK : size;
+    long i = k * RUNBLOCK + 1;
+    /* include the boundary with the previous block */
+    if (k > 0)
+      i--;
+    while (i < end && low[i] < low[i - 1])
+      i++;
+    desc[k] = i == end;
+  }
+  total = 0;
+  for (long k = 0; k < nblocks; k++)
+    total += desc[k];
+  free(desc);
+  if (total == nblocks) {
+    reverse(low, size);
+    return;
+  }
+
+  /* find the runs of each block in parallel, then compact them */
+  bounds = (long *)malloc((nblocks * maxruns + 1) * sizeof(long));
+  nruns = (long *)malloc(nblocks * sizeof(long));
+  cilk_for (long k = 0; k < nblocks; k++) {
+    long start = k * RUNBLOCK;
+    long n = size - start < RUNBLOCK ? size - start : RUNBLOCK;
+    nruns[k] = find_runs(low + start, tmp + start, n, bounds + k * maxruns);
+    for (long r = 0; r < nruns[k]; r++)
+      bounds[k * maxruns + r] += start;
+  }
+
+  /* keep only the starts of runs that are out of order with their left */
+  total = 0;
+  for (long k = 0; k < nblocks; k++)
+    for (long r = 0; r < nruns[k]; r++) {
+      long b = bounds[k * maxruns + r];
+      if (b == 0 || low[b - 1] > low[b])
+        bounds[total++] = b;
+    }
+  bounds[total] = size;
+
+  if (total > 1)
+    merge_runs(low, tmp, bounds, 0, total, 0);
+
+  free(bounds);
+  free(nruns);
+}
+
+/*
+ * Key-value sorting.
+ *
+ * cilksort_kv sorts the keys in low[0..size) and permutes the payload
+ * vlow[0..size) in lockstep; tmp and vtmp are scratch arrays of the same
+ * sizes.  The routines below mirror seqquick, seqmerge, cilkmerge and
+ * cilksort, except that every move of a key is matched by a move of the
+ * corresponding payload.  The merge position search (binsplit) only looks
+ * at keys and is shared.
+ */
+typedef long VAL;
+
+static ELM *seqpart_kv(ELM *low, ELM *high, VAL *vlow) {
+
+  ELM pivot;
+  ELM h, l;
+  ELM *curr_low = low;
+  ELM *curr_high = high;
+  VAL tv;
+
+  pivot = choose_pivot(low, high);
+
+  while (1) {
+    while ((h = *curr_high) > pivot)
+      curr_high--;
+
+    while ((l = *curr_low) < pivot)
+      curr_low++;
+
+    if (curr_low >= curr_high)
+      break;
+
+    tv = vlow[curr_high - low];
+    vlow[curr_high - low] = vlow[curr_low - low];
+    vlow[curr_low - low] = tv;
+    *curr_high-- = l;
+    *curr_low++ = h;
+  }
+
+  if (curr_high < high)
+    return curr_high;
+  else
+    return curr_high - 1;
+}
+
+static void insertion_sort_kv(ELM *low, ELM *high, VAL *vlow) {
+
+  ELM *p, *q;
+  ELM a, b;
+  VAL va;
+
+  for (q = low + 1; q <= high; ++q) {
+    a = q[0];
+    va = vlow[q - low];
+    for (p = q - 1; p >= low && (b = p[0]) > a; p--) {
+      p[1] = b;
+      vlow[p - low + 1] = vlow[p - low];
+    }
+    p[1] = a;
+    vlow[p - low + 1] = va;
+  }
+}
+
+void seqquick_kv(ELM *low, ELM *high, VAL *vlow) {
+
+  ELM *p;
+
+  while (high - low >= INSERTIONSIZE) {
+    p = seqpart_kv(low, high, vlow);
+    seqquick_kv(low, p, vlow);
+    vlow += p + 1 - low;
+    low = p + 1;
+  }
+
+  insertion_sort_kv(low, high, vlow);
+}
+
+void seqmerge_kv(ELM *low1, ELM *high1, ELM *low2, ELM *high2, ELM *lowdest,
+                 VAL *vlow1, VAL *vlow2, VAL *vlowdest) {
+
+  while (low1 <= high1 && low2 <= high2) {
+    if (*low1 < *low2) {
+      *lowdest++ = *low1++;
+      *vlowdest++ = *vlow1++;
+    } else {
+      *lowdest++ = *low2++;
+      *vlowdest++ = *vlow2++;
+    }
+  }
+  if (low1 > high1) {
+    memcpy(lowdest, low2, sizeof(ELM) * (high2 - low2 + 1));
+    memcpy(vlowdest, vlow2, sizeof(VAL) * (high2 - low2 + 1));
+  } else {
+    memcpy(lowdest, low1, sizeof(ELM) * (high1 - low1 + 1));
+    memcpy(vlowdest, vlow1, sizeof(VAL) * (high1 - low1 + 1));
+  }
+}
+
+void cilkmerge_kv(ELM *low1, ELM *high1, ELM *low2, ELM *high2, ELM *lowdest,
+                  VAL *vlow1, VAL *vlow2, VAL *vlowdest) {
+
+  ELM *split1, *split2;
+  long int lowsize;
+
+  if (high2 - low2 > high1 - low1) {
+    swap_indices(low1, low2);
+    swap_indices(high1, high2);
+    VAL *vt = vlow1;
+    vlow1 = vlow2;
+    vlow2 = vt;
+  }
+
+  if (high1 < low1) {
+    /* smaller range is empty */
+    memcpy(lowdest, low2, sizeof(ELM) * (high2 - low2));
+    memcpy(vlowdest, vlow2, sizeof(VAL) * (high2 - low2));
+    return;
+  }
+
+  if (high2 - low2 < MERGESIZE) {
+    seqmerge_kv(low1, high1, low2, high2, lowdest, vlow1, vlow2, vlowdest);
+    return;
+  }
+
+  split1 = ((high1 - low1 + 1) / 2) + low1;
+  split2 = binsplit(*split1, low2, high2);
+  lowsize = split1 - low1 + split2 - low2;
+
+  *(lowdest + lowsize + 1) = *split1;
+  *(vlowdest + lowsize + 1) = vlow1[split1 - low1];
+
+  cilk_scope {
+    cilk_spawn cilkmerge_kv(low1, split1 - 1, low2, split2, lowdest, vlow1,
+                            vlow2, vlowdest);
+    cilkmerge_kv(split1 + 1, high1, split2 + 1, high2, lowdest + lowsize + 2,
+                 vlow1 + (split1 - low1) + 1, vlow2 + (split2 - low2) + 1,
+                 vlowdest + lowsize + 2);
+  }
+}
+
+void cilksort_kv(ELM *low, ELM *tmp, VAL *vlow, VAL *vtmp, long size) {
+
+  long quarter = size / 4;
+
+  if (size < QUICKSIZE) {
+    seqquick_kv(low, low + size - 1, vlow);
+    return;
+  }
+
+  ELM *A = low, *B = A + quarter, *C = B + quarter, *D = C + quarter;
+  ELM *tmpA = tmp, *tmpC = tmpA + 2 * quarter;
+  VAL *vA = vlow, *vB = vA + quarter, *vC = vB + quarter, *vD = vC + quarter;
+  VAL *vtmpA = vtmp, *vtmpC = vtmpA + 2 * quarter;
+
+  cilk_scope {
+    cilk_spawn cilksort_kv(A, tmp, vA, vtmp, quarter);
+    cilk_spawn cilksort_kv(B, tmp + quarter, vB, vtmp + quarter, quarter);
+    cilk_spawn cilksort_kv(C, tmpC, vC, vtmpC, quarter);
+    cilksort_kv(D, tmpC + quarter, vD, vtmpC + quarter, size - 3 * quarter);
+    cilk_sync;
+
+    cilk_spawn cilkmerge_kv(A, A + quarter - 1, B, B + quarter - 1, tmpA, vA,
+                            vB, vtmpA);
+    cilkmerge_kv(C, C + quarter - 1, D, low + size - 1, tmpC, vC, vD, vtmpC);
+  }
+
+  cilkmerge_kv(tmpA, tmpC - 1, tmpC, tmpA + size - 1, A, vtmpA, vtmpC, vA);
+}
+
+/*
+ * Store in idx the permutation that sorts keys[0..size), leaving keys
+ * untouched: keys[idx[0]] <= keys[idx[1]] <= ...
+ */
+void argsort(const ELM *keys, VAL *idx, long size) {
+
+  ELM *k = (ELM *)malloc(size * sizeof(ELM));
+  ELM *ktmp = (ELM *)malloc(size * sizeof(ELM));
+  VAL *itmp = (VAL *)malloc(size * sizeof(VAL));
+
+  cilk_for (long i = 0; i < size; i++) {
+    k[i] = keys[i];
+    idx[i] = i;
+  }
+  cilksort_kv(k, ktmp, idx, itmp, size);
+
+  free(k);
+  free(ktmp);
+  free(itmp);
+}
+
+/*
+ * Stable key-value sorting.
+ *
+ * stablesort sorts keys[0..size) and permutes vals[0..size) in lockstep,
+ * keeping pairs with equal keys in their input order.  It has the shape of
+ * cilksort_kv, but the leaves are stable merge sorts and the merges never
+ * let an element of the right run overtake an equal element of the left
+ * run.  The scratch space lives in a sort_buffer owned by the caller, which
+ * only grows, so a sequence of sorts allocates and faults in its scratch
+ * pages once.
+ */
+typedef struct {
+  ELM *keys;
+  VAL *vals;
+  long capacity;
+} sort_buffer;
+
+#define SORT_BUFFER_INIT {NULL, NULL, 0}
+
+/* make buf hold at least size pairs, touching new pages in parallel */
+void sort_buffer_reserve(sort_buffer *buf, long size) {
+
+  if (size <= buf->capacity)
+    return;
+
+  free(buf->keys);
+  free(buf->vals);
+  buf->keys = (ELM *)malloc(size * sizeof(ELM));
+  buf->vals = (VAL *)malloc(size * sizeof(VAL));
+  buf->capacity = size;
+  cilk_for (long i = 0; i < size; i += 4 * KILO / sizeof(VAL)) {
+    buf->keys[i] = 0;
+    buf->vals[i] = 0;
+  }
+}
+
+void sort_buffer_release(sort_buffer *buf) {
+
+  free(buf->keys);
+  free(buf->vals);
+  buf->keys = NULL;
+  buf->vals = NULL;
+  buf->capacity = 0;
+}
+
+/* number of keys in a[0..n) that are < val, or <= val if inclusive */
+static long rank_of(const ELM *a, long n, ELM val, int inclusive) {
+
+  long lo = 0, hi = n;
+
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (a[mid] < val || (inclusive && a[mid] == val))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* merge the left run a and the right run b into d; ties take from a */
+static void seqmerge_stable(const ELM *a, const VAL *va, long na,
+                            const ELM *b, const VAL *vb, long nb, ELM *d,
+                            VAL *vd) {
+
+  const ELM *ea = a + na, *eb = b + nb;
+
+  while (a < ea && b < eb) {
+    if (*b < *a) {
+      *d++ = *b++;
+      *vd++ = *vb++;
+    } else {
+      *d++ = *a++;
+      *vd++ = *va++;
+    }
+  }
+  memcpy(d, a, (ea - a) * sizeof(ELM));
+  memcpy(vd, va, (ea - a) * sizeof(VAL));
+  d += ea - a;
+  vd += ea - a;
+  memcpy(d, b, (eb - b) * sizeof(ELM));
+  memcpy(vd, vb, (eb - b) * sizeof(VAL));
+}
+
+/*
+ * Split the larger run at its middle key x.  If x comes from the left run,
+ * right-run keys equal to x belong after it; if it comes from the right
+ * run, left-run keys equal to x belong before it.
+ */
+void cilkmerge_stable(const ELM *a, const VAL *va, long na, const ELM *b,
+                      const VAL *vb, long nb, ELM *d, VAL *vd) {
+
+  long ma, mb;
+
+  if (na + nb <= MERGESIZE) {
+    seqmerge_stable(a, va, na, b, vb, nb, d, vd);
+    return;
+  }
+
+  if (na >= nb) {
+    ma = na / 2;
+    mb = rank_of(b, nb, a[ma], 0);
+  } else {
+    mb = nb / 2;
+    ma = rank_of(a, na, b[mb], 1);
+  }
+
+  cilk_scope {
+    cilk_spawn cilkmerge_stable(a, va, ma, b, vb, mb, d, vd);
+    cilkmerge_stable(a + ma, va + ma, na - ma, b + mb, vb + mb, nb - mb,
+                     d + ma + mb, vd + ma + mb);
+  }
+}
+
+/* insertion sort short runs, then merge them bottom-up through tmp */
+static void stable_leaf(ELM *low, VAL *vlow, ELM *tmp, VAL *vtmp, long size) {
+
+  ELM *src = low, *dst = tmp;
+  VAL *vsrc = vlow, *vdst = vtmp;
+
+  for (long i = 0; i < size; i += INSERTIONSIZE) {
+    long n = size - i < INSERTIONSIZE ? size - i : INSERTIONSIZE;
+    insertion_sort_kv(low + i, low + i + n - 1, vlow + i);
+  }
+
+  for (long w = INSERTIONSIZE; w < size; w *= 2) {
+    for (long i = 0; i < size; i += 2 * w) {
+      long mid = i + w < size ? i + w : size;
+      long hi = i + 2 * w < size ? i + 2 * w : size;
+      seqmerge_stable(src + i, vsrc + i, mid - i, src + mid, vsrc + mid,
+                      hi - mid, dst + i, vdst + i);
+    }
+    swap_indices(src, dst);
+    VAL *vt = vsrc;
+    vsrc = vdst;
+    vdst = vt;
+  }
+
+  if (src != low) {
+    memcpy(low, src, size * sizeof(ELM));
+    memcpy(vlow, vsrc, size * sizeof(VAL));
+  }
+}
+
+static void stablesort_rec(ELM *low, VAL *vlow, ELM *tmp, VAL *vtmp,
+                           long size) {
+
+  long quarter = size / 4;
+
+  if (size < QUICKSIZE) {
+    stable_leaf(low, vlow, tmp, vtmp, size);
+    return;
+  }
+
+  ELM *A = low, *B = A + quarter, *C = B + quarter, *D = C + quarter;
+  ELM *tmpA = tmp, *tmpC = tmpA + 2 * quarter;
+  VAL *vA = vlow, *vB = vA + quarter, *vC = vB + quarter, *vD = vC + quarter;
+  VAL *vtmpA = vtmp, *vtmpC = vtmpA + 2 * quarter;
+
+  cilk_scope {
+    cilk_spawn stablesort_rec(A, vA, tmpA, vtmpA, quarter);
+    cilk_spawn stablesort_rec(B, vB, tmpA + quarter, vtmpA + quarter, quarter);
+    cilk_spawn stablesort_rec(C, vC, tmpC, vtmpC, quarter);
+    stablesort_rec(D, vD, tmpC + quarter, vtmpC + quarter, size - 3 * quarter);
+    cilk_sync;
+
+    cilk_spawn cilkmerge_stable(A, vA, quarter, B, vB, quarter, tmpA, vtmpA);
+    cilkmerge_stable(C, vC, quarter, D, vD, size - 3 * quarter, tmpC, vtmpC);
+  }
+
+  cilkmerge_stable(tmpA, vtmpA, 2 * quarter, tmpC, vtmpC, size - 2 * quarter,
+                   A, vA);
+}
+
+void stablesort(ELM *keys, VAL *vals, long size, sort_buffer *buf) {
+
+  sort_buffer_reserve(buf, size);
+  stablesort_rec(keys, vals, buf->keys, buf->vals, size);
+}
+
+/*
+ * External-memory sort for inputs larger than RAM.
+ *
+ * The input is a binary file of ELMs.  With a memory budget of M bytes,
+ *
+ *   1) run formation: read the file in chunks of M / 3 bytes, cilksort
+ *      each chunk and append it as a sorted run to a scratch file.  The
+ *      read of the next chunk and the write of the previous one proceed in
+ *      the background while the current chunk is sorted.
+ *   2) merge: every run gets two buffers, one being consumed and one being
+ *      filled in the background.  Each round finds the smallest last key
+ *      among the buffers of runs with more data on disk; every buffered key
+ *      up to that bound can be output, and at least one buffer drains
+ *      completely.  The keys of a round are merged in parallel by a tree of
+ *      cilkmerges, and written out in the background while the next round
+ *      is merged.
+ *
+ * Background I/O is done by one POSIX thread per request, so the Cilk
+ * workers never block on the disk.
+ */
+typedef struct {
+  pthread_t thread;
+  int fd, write, active;
+  char *buf;
+  size_t bytes;
+  off_t offset;
+} aio_req;
+
+static void *aio_worker(void *arg) {
+
+  aio_req *r = (aio_req *)arg;
+  size_t done = 0;
+
+  while (done < r->bytes) {
+    ssize_t k = r->write
+                    ? pwrite(r->fd, r->buf + done, r->bytes - done,
+                             r->offset + done)
+                    : pread(r->fd, r->buf + done, r->bytes - done,
+                            r->offset + done);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0) {
+      perror(r->write ? "extsort: write" : "extsort: read");
+      exit(1);
+    }
+    done += k;
+  }
+
+  return NULL;
+}
+
+static void aio_start(aio_req *r, int fd, int write, void *buf, size_t bytes,
+                      off_t offset) {
+
+  r->fd = fd;
+  r->write = write;
+  r->buf = (char *)buf;
+  r->bytes = bytes;
+  r->offset = offset;
+  r->active = 1;
+  if (pthread_create(&r->thread, NULL, aio_worker, r)) {
+    fprintf(stderr, "extsort: cannot create I/O thread\n");
+    exit(1);
+  }
+}
+
+static void aio_wait(aio_req *r) {
+
+  if (r->active)
+    pthread_join(r->thread, NULL);
+  r->active = 0;
+}
+
+/*
+ * Merge the k sorted segments seg[i][0..len[i]) into dest.  scratch must
+ * have room for all the keys; the two halves of the segments are merged
+ * into scratch (using dest as their scratch) and then into dest.
+ */
+static void multiway_merge(ELM **seg, long *len, int k, ELM *dest,
+                           ELM *scratch) {
+
+  long nl = 0, nr = 0;
+  int h = k / 2;
+
+  if (k == 1) {
+    memcpy(dest, seg[0], len[0] * sizeof(ELM));
+    return;
+  }
+
+  for (int i = 0; i < h; i++)
+    nl += len[i];
+  for (int i = h; i < k; i++)
+    nr += len[i];
+
+  cilk_scope {
+    cilk_spawn multiway_merge(seg, len, h, scratch, dest);
+    multiway_merge(seg + h, len + h, k - h, scratch + nl, dest + nl);
+  }
+
+  if (nl == 0 || nr == 0)
+    memcpy(dest, scratch, (nl + nr) * sizeof(ELM));
+  else
+    cilkmerge(scratch, scratch + nl - 1, scratch + nl, scratch + nl + nr - 1,
+              dest);
+}
+
+typedef struct {
+  ELM *cur, *nxt;
+  long pos, len; /* unconsumed keys are cur[pos..len) */
+  long nxtlen;   /* keys being read into nxt */
+  long off, end; /* next key of the run to read, end of the run */
+  long take;     /* keys output in the current round */
+  aio_req rd;
+} ext_run;
+
+static void ext_prefetch(ext_run *r, int fd, long blk) {
+
+  r->nxtlen = r->end - r->off < blk ? r->end - r->off : blk;
+  if (r->nxtlen > 0) {
+    aio_start(&r->rd, fd, 0, r->nxt, r->nxtlen * sizeof(ELM),
+              r->off * sizeof(ELM));
+    r->off += r->nxtlen;
+  }
+}
+
+static void ext_advance(ext_run *r, int fd, long blk) {
+
+  ELM *t;
+
+  aio_wait(&r->rd);
+  t = r->cur;
+  r->cur = r->nxt;
+  r->nxt = t;
+  r->pos = 0;
+  r->len = r->nxtlen;
+  ext_prefetch(r, fd, blk);
+}
+
+/* number of keys in a[0..n) that are <= val */
+static long count_le(const ELM *a, long n, ELM val) {
+
+  long lo = 0, hi = n;
+
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (a[mid] <= val)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/*
+ * Sort the size keys in infd into outfd, with runs in scratchfd, using
+ * about membytes of memory.  Returns the number of runs.
+ */
+long extsort(int infd, int outfd, int scratchfd, long size, long membytes) {
+
+  long chunk = membytes / (3 * (long)sizeof(ELM));
+  long nruns = (size + chunk - 1) / chunk;
+  aio_req rd = {0}, wr = {0};
+  struct timeval t1, t2;
+
+  if (size == 0)
+    return 0;
+
+  /* 1) run formation */
+  gettimeofday(&t1, 0);
+  ELM *cur = (ELM *)malloc(chunk * sizeof(ELM));
+  ELM *nxt = (ELM *)malloc(chunk * sizeof(ELM));
+  ELM *tmp = (ELM *)malloc(chunk * sizeof(ELM));
+  ELM *t;
+
+  aio_start(&rd, infd, 0, cur, (size < chunk ? size : chunk) * sizeof(ELM), 0);
+  for (long r = 0; r < nruns; r++) {
+    long off = r * chunk;
+    long n = size - off < chunk ? size - off : chunk;
+    long nn = size - off - n < chunk ? size - off - n : chunk;
+
+    aio_wait(&rd);
+    aio_wait(&wr); /* nxt was written out last iteration */
+    if (nn > 0)
+      aio_start(&rd, infd, 0, nxt, nn * sizeof(ELM), (off + n) * sizeof(ELM));
+    cilksort(cur, tmp, n);
+    aio_start(&wr, scratchfd, 1, cur, n * sizeof(ELM), off * sizeof(ELM));
+    t = cur;
+    cur = nxt;
+    nxt = t;
+  }
+  aio_wait(&wr);
+  free(cur);
+  free(nxt);
+  free(tmp);
+  gettimeofday(&t2, 0);
+  fprintf(stderr, "extsort: %ld runs of %ld keys formed in %f s\n", nruns,
+          chunk, (todval(&t2) - todval(&t1)) / 1000000.0);
+
+  /* 2) merge */
+  gettimeofday(&t1, 0);
+  long blk = membytes / (5 * nruns * (long)sizeof(ELM));
+  if (blk < KILO) {
+    blk = KILO;
+    fprintf(stderr, "extsort: warning: too many runs for the memory budget\n");
+  }
+
+  ext_run *runs = (ext_run *)calloc(nruns, sizeof(ext_run));
+  ELM **seg = (ELM **)malloc(nruns * sizeof(ELM *));
+  long *len = (long *)malloc(nruns * sizeof(long));
+  ELM *out[2], *scratch;
+  aio_req owr[2] = {{0}, {0}};
+  long outoff = 0;
+  int ob = 0;
+
+  out[0] = (ELM *)malloc(nruns * blk * sizeof(ELM));
+  out[1] = (ELM *)malloc(nruns * blk * sizeof(ELM));
+  scratch = (ELM *)malloc(nruns * blk * sizeof(ELM));
+
+  for (long r = 0; r < nruns; r++) {
+    runs[r].cur = (ELM *)malloc(blk * sizeof(ELM));
+    runs[r].nxt = (ELM *)malloc(blk * sizeof(ELM));
+    runs[r].off = r * chunk;
+    runs[r].end = size < (r + 1) * chunk ? size : (r + 1) * chunk;
+    ext_prefetch(&runs[r], scratchfd, blk);
+    ext_advance(&runs[r], scratchfd, blk);
+  }
+
+  while (outoff < size) {
+    int bounded = 0, k = 0;
+    ELM bound = 0;
+    long total = 0;
+
+    for (long r = 0; r < nruns; r++) {
+      ext_run *p = &runs[r];
+      if (p->pos < p->len && p->nxtlen > 0 &&
+          (!bounded || p->cur[p->len - 1] < bound)) {
+        bound = p->cur[p->len - 1];
+        bounded = 1;
+      }
+    }
+
+    for (long r = 0; r < nruns; r++) {
+      ext_run *p = &runs[r];
+      p->take = p->len - p->pos;
+      if (bounded)
+        p->take = count_le(p->cur + p->pos, p->take, bound);
+      if (p->take > 0) {
+        seg[k] = p->cur + p->pos;
+        len[k++] = p->take;
+        total += p->take;
+      }
+    }
+
+    aio_wait(&owr[ob]);
+    multiway_merge(seg, len, k, out[ob], scratch);
+    aio_start(&owr[ob], outfd, 1, out[ob], total * sizeof(ELM),
+              outoff * sizeof(ELM));
+    outoff += total;
+    ob ^= 1;
+
+    /* the merge read the segments in place; only now release them */
+    for (long r = 0; r < nruns; r++) {
+      ext_run *p = &runs[r];
+      p->pos += p->take;
+      if (p->pos == p->len && p->nxtlen > 0)
+        ext_advance(p, scratchfd, blk);
+    }
+  }
+  aio_wait(&owr[0]);
+  aio_wait(&owr[1]);
+
+  for (long r = 0; r < nruns; r++) {
+    free(runs[r].cur);
+    free(runs[r].nxt);
+  }
+  free(runs);
+  free(seg);
+  free(len);
+  free(out[0]);
+  free(out[1]);
+  free(scratch);
+  gettimeofday(&t2, 0);
+  fprintf(stderr, "extsort: %ld-way merge with %ld-key buffers in %f s\n",
+          nruns, blk, (todval(&t2) - todval(&t1)) / 1000000.0);
+
+  return nruns;
+}
+
+static long gcd(long a, long b) {
+
+  while (b) {
+    long t = a % b;
+    a = b;
+    b = t;
+  }
+
+  return a;
+}
+
+/*
+ * Read the size keys of fd through buf, bufsize keys at a time, and add
+ * up their sum and xor, which do not depend on the order of the keys.
+ * With sorted set the keys must also be nondecreasing, and with ident
+ * they must be exactly 0..size-1.  Returns 0 on a short read or a key
+ * that breaks these conditions.
+ */
+static int ext_scan(int fd, long size, ELM *buf, long bufsize, int sorted,
+                    int ident, unsigned long *sum, unsigned long *xor) {
+
+  ELM prev = 0;
+
+  *sum = *xor = 0;
+  for (long off = 0; off < size; off += bufsize) {
+    long n = size - off < bufsize ? size - off : bufsize;
+    if (pread(fd, buf, n * sizeof(ELM), off * sizeof(ELM)) !=
+        (ssize_t)(n * sizeof(ELM)))
+      return 0;
+    for (long i = 0; i < n; i++) {
+      if ((sorted && off + i > 0 && buf[i] < prev) ||
+          (ident && buf[i] != off + i))
+        return 0;
+      prev = buf[i];
+      *sum += (unsigned long)buf[i];
+      *xor ^= (unsigned long)buf[i];
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Out-of-core driver: optionally write a scrambled permutation of
+ * 0..size-1 to infile, sort it into outfile, and optionally check that the output is a sorted
+ * rearrangement of the input.
+ */
+int extsort_main(const char *infile, const char *outfile, const char *tmpdir,
+                 long size, long mem_mb, int gen, int check) {
+
+  long bufsize = 1024 * KILO;
+  ELM *buf = (ELM *)malloc(bufsize * sizeof(ELM));
+  char scratchname[4096];
+  struct stat st;
+  int infd, outfd, scratchfd;
+  int success = 1;
+  unsigned long in_sum = 0, in_xor = 0, out_sum, out_xor;
+
+  if (mem_mb <= 0 || (gen && size <= 0)) {
+    fprintf(stderr, "extsort: invalid size or memory budget\n");
+    return 1;
+  }
+
+  if (gen) {
+    /* key i is a * i mod size, a permutation whenever gcd(a, size) = 1 */
+    unsigned long a = 0x9e3779b97f4a7c15UL % size;
+    while (gcd(a, size) != 1)
+      a++;
+    infd = open(infile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (infd < 0) {
+      perror(infile);
+      return 1;
+    }
+    for (long off = 0; off < size; off += bufsize) {
+      long n = size - off < bufsize ? size - off : bufsize;
+      cilk_for (long i = 0; i < n; i++)
+        buf[i] = (ELM)((unsigned __int128)a * (off + i) % size);
+      if (write(infd, buf, n * sizeof(ELM)) != (ssize_t)(n * sizeof(ELM))) {
+        perror(infile);
+        return 1;
+      }
+    }
+    close(infd);
+  }
+
+  infd = open(infile, O_RDONLY);
+  if (infd < 0 || fstat(infd, &st) < 0) {
+    perror(infile);
+    return 1;
+  }
+  if (st.st_size % sizeof(ELM)) {
+    fprintf(stderr, "%s: size is not a multiple of %zu bytes\n", infile,
+            sizeof(ELM));
+    return 1;
+  }
+  size = st.st_size / sizeof(ELM);
+  if (check && !ext_scan(infd, size, buf, bufsize, 0, 0, &in_sum, &in_xor)) {
+    perror(infile);
+    return 1;
+  }
+
+  outfd = open(outfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (outfd < 0) {
+    perror(outfile);
+    return 1;
+  }
+  snprintf(scratchname, sizeof(scratchname), "%s/cilksort-runs-XXXXXX",
+           tmpdir);
+  scratchfd = mkstemp(scratchname);
+  if (scratchfd < 0) {
+    perror(scratchname);
+    return 1;
+  }
+  unlink(scratchname);
+
+  struct timeval t1, t2;
+  gettimeofday(&t1, 0);
+  extsort(infd, outfd, scratchfd, size, mem_mb * KILO * KILO);
+  gettimeofday(&t2, 0);
+  unsigned long long runtime_ms = (todval(&t2) - todval(&t1)) / 1000;
+  printf("%f\n", runtime_ms / 1000.0);
+
+  if (check) {
+    printf("Now check result ... \n");
+    success = fstat(outfd, &st) == 0 &&
+              st.st_size == (off_t)(size * sizeof(ELM)) &&
+              ext_scan(outfd, size, buf, bufsize, 1, gen, &out_sum,
+                       &out_xor) &&
+              out_sum == in_sum && out_xor == in_xor;
+    if (!success)
+      fprintf(stderr, "SORTING FAILURE!");
+    else
+      fprintf(stderr, "Sorting successful.");
+  }
+
+  fprintf(stderr, "\nCilk Example: cilksort (out of core)\n");
+  fprintf(stderr, "options: number of elements = %ld\n", size);
+  fprintf(stderr, "         memory = %ld MB, input = %s, output = %s\n\n",
+          mem_mb, infile, outfile);
+
+  close(infd);
+  close(outfd);
+  close(scratchfd);
+  free(buf);
+
+  return !success;
+}
+
+/*
+ * Fill arr with a random permutation of 0..size-1 that depends only on the
+ * seed (see randinput.h).
+ */
+void fill_array(ELM *arr, unsigned long size, unsigned long seed) {
+
+  random_permutation(arr, size, seed);
+}
+
+/*
+ * Count the positions in [lo, hi) where the sorted output is wrong.  The
+ * expected output is 0..size-1 for the keys alone, with the negated keys as
+ * payload (CHECK_KV), or as the keys permuted by vals (CHECK_ARGSORT).  For
+ * CHECK_STABLE the keys are 0..size-1 divided by STABLE_DUPS and every
+ * payload is key * size + input position, so a stable sort leaves the
+ * payloads strictly increasing.
+ */
+#define CHECKSIZE (16 * KILO)
+#define CHECK_KEYS 0
+#define CHECK_KV 1
+#define CHECK_ARGSORT 2
+#define CHECK_STABLE 3
+#define STABLE_DUPS 8
+
+long count_errors(const ELM *arr, const VAL *vals, int mode, long size,
+                  long lo, long hi) {
+
+  if (hi - lo <= CHECKSIZE) {
+    long bad = 0;
+    for (long i = lo; i < hi; ++i) {
+      if (mode == CHECK_ARGSORT)
+        bad += arr[vals[i]] != i;
+      else if (mode == CHECK_STABLE)
+        bad += arr[i] != i / STABLE_DUPS || vals[i] / size != arr[i] ||
+               (i > 0 && vals[i] <= vals[i - 1]);
+      else
+        bad += arr[i] != i || (mode == CHECK_KV && vals[i] != -i);
+    }
+    return bad;
+  }
+
+  long mid = lo + (hi - lo) / 2;
+  long a = cilk_spawn count_errors(arr, vals, mode, size, lo, mid);
+  long b = count_errors(arr, vals, mode, size, mid, hi);
+  cilk_sync;
+
+  return a + b;
+}
+
+/*
+ * Refill the array to model presorted inputs: "sorted", "reverse", "runs"
+ * (64 interleaved ascending runs) or "nearly" (or "nearly-sorted": sorted,
+ * with 1% of the keys swapped).  "random" keeps the filled permutation.
+ * Every order is generated in parallel and depends only on the seed.
+ */
+int order_array(ELM *arr, long size, const char *order, unsigned long seed) {
+
+  if (!strcmp(order, "sorted")) {
+    cilk_for (long i = 0; i < size; ++i)
+      arr[i] = i;
+  } else if (!strcmp(order, "nearly") || !strcmp(order, "nearly-sorted")) {
+    nearly_order(arr, size, seed);
+  } else if (!strcmp(order, "reverse")) {
+    cilk_for (long i = 0; i < size; ++i)
+      arr[i] = size - 1 - i;
+  } else if (!strcmp(order, "runs")) {
+    runs_order(arr, size, 64);
+  } else if (strcmp(order, "random")) {
+    return 0;
+  }
+
+  return 1;
 }
 
 int usage(void) {
 
   fprintf(stderr, "\nUsage: cilksort [<cilk-options>] [-n size] [-c] "
-                  "[-benchmark] [-h]\n\n");
+                  "[-sample] [-adaptive] [-order o] [-kv] [-argsort]\n"
+                  "                [-stable] [-seed s] [-benchmark] [-h]\n");
+  fprintf(stderr, "       cilksort [<cilk-options>] -f file [-o file] "
+                  "[-m MB] [-T dir] [-gen]\n"
+                  "                [-n size] [-c]\n\n");
   fprintf(stderr, "Cilksort is a parallel sorting algorithm, "
                   "donned \"Multisort\", which\n");
   fprintf(stderr, "is a variant of ordinary mergesort.  "
@@ -447,30 +1861,79 @@ int usage(void) {
   fprintf(stderr, "two sorted halves back together, "
                   "but in a divide-and-conquer approach\n");
   fprintf(stderr, "rather than the usual serial merge.\n\n");
+  fprintf(stderr, "With -sample, sort with a parallel sample sort instead, "
+                  "which partitions\n");
+  fprintf(stderr, "the input into buckets in one pass and sorts the "
+                  "buckets independently.\n\n");
+  fprintf(stderr, "With -adaptive, sort with a natural mergesort that "
+                  "merges the presorted\n");
+  fprintf(stderr, "runs of the input.  -order random, sorted, reverse, runs "
+                  "or nearly\n");
+  fprintf(stderr, "(also nearly-sorted) selects the input order.  -seed "
+                  "selects the random\n");
+  fprintf(stderr, "input, which is the same for any number of workers.\n\n");
+  fprintf(stderr, "With -kv, sort keys together with a payload array; with "
+                  "-argsort, compute\n");
+  fprintf(stderr, "the sorting permutation of the keys.  Both also time a "
+                  "key-only cilksort\n");
+  fprintf(stderr, "of the same input for comparison.  -stable sorts "
+                  "key-value pairs with\n");
+  fprintf(stderr, "%d copies of every key, keeping equal keys in input "
+                  "order, with scratch\n", STABLE_DUPS);
+  fprintf(stderr, "space reserved once ahead of the sort.\n\n");
+  fprintf(stderr, "With -f file, sort the binary file of keys out of core "
+                  "into -o file\n");
+  fprintf(stderr, "(default file.sorted), using -m megabytes of memory "
+                  "(default 1024) and\n");
+  fprintf(stderr, "scratch space in directory -T (default /tmp).  -gen "
+                  "first writes a\n");
+  fprintf(stderr, "scrambled permutation of -n keys to the input file.\n\n");
 
   return -1;
 }
 
-const char *specifiers[] = {"-n", "-c", "-benchmark", "-h", 0};
-int opt_types[] = {LONGARG, BOOLARG, BENCHMARK, BOOLARG, 0};
+const char *specifiers[] = {"-n",  "-c",       "-benchmark", "-h", "-sample",
+                            "-kv", "-argsort", "-f",         "-o", "-m",
+                            "-T",  "-gen",     "-adaptive",  "-order",
+                            "-seed", "-stable", 0};
+int opt_types[] = {LONGARG,   BOOLARG,   BENCHMARK, BOOLARG,
+                   BOOLARG,   BOOLARG,   BOOLARG,   STRINGARG,
+                   STRINGARG, LONGARG,   STRINGARG, BOOLARG,
+                   BOOLARG,   STRINGARG, LONGARG,   BOOLARG,
+                   0};
 
 int main(int argc, char **argv) {
 
   long size;
   ELM *array, *tmp;
-  long i;
-  int success, benchmark, help, check;
+  VAL *vals = NULL, *vtmp = NULL;
+  int success, benchmark, help, check, sample, kv, argsort_mode, gen;
+  int adaptive, stable;
+  int mode = CHECK_KEYS;
+  sort_buffer buf = SORT_BUFFER_INIT;
+  const char *algorithm;
+  char infile[4096] = "", outfile[4096] = "", tmpdir[4096] = "/tmp";
+  char order[64] = "random";
+  long mem_mb = 1024;
+  long seed = 1;
 
   /* standard benchmark options */
   check = 0;
   size = 3000000;
 
   get_options(argc, argv, specifiers, opt_types, &size, &check, &benchmark,
-              &help);
+              &help, &sample, &kv, &argsort_mode, infile, outfile, &mem_mb,
+              tmpdir, &gen, &adaptive, order, &seed, &stable);
 
   if (help)
     return usage();
 
+  if (infile[0]) {
+    if (!outfile[0])
+      snprintf(outfile, sizeof(outfile), "%s.sorted", infile);
+    return extsort_main(infile, outfile, tmpdir, size, mem_mb, gen, check);
+  }
+
   if (benchmark) {
     switch (benchmark) {
     case 1: /* short benchmark options -- a little work */
@@ -487,11 +1950,57 @@ int main(int argc, char **argv) {
   array = (ELM *)malloc(size * sizeof(ELM));
   tmp = (ELM *)malloc(size * sizeof(ELM));
 
-  fill_array(array, size);
+  fill_array(array, size, seed);
+  if (!order_array(array, size, order, seed)) {
+    fprintf(stderr, "Unknown input order %s\n", order);
+    return usage();
+  }
+
+  if (argsort_mode) {
+    algorithm = "argsort";
+    mode = CHECK_ARGSORT;
+    vals = (VAL *)malloc(size * sizeof(VAL));
+  } else if (stable) {
+    algorithm = "stablesort";
+    mode = CHECK_STABLE;
+    vals = (VAL *)malloc(size * sizeof(VAL));
+    cilk_for (long i = 0; i < size; ++i) {
+      array[i] /= STABLE_DUPS;
+      vals[i] = (VAL)array[i] * size + i;
+    }
+    /* a long-lived caller reserves its scratch space once, up front */
+    struct timeval r1, r2;
+    gettimeofday(&r1, 0);
+    sort_buffer_reserve(&buf, size);
+    gettimeofday(&r2, 0);
+    fprintf(stderr, "stablesort: reserved scratch space in %f s\n",
+            (todval(&r2) - todval(&r1)) / 1000000.0);
+  } else if (kv) {
+    algorithm = "cilksort_kv";
+    mode = CHECK_KV;
+    vals = (VAL *)malloc(size * sizeof(VAL));
+    vtmp = (VAL *)malloc(size * sizeof(VAL));
+    /* payload is the negated key */
+    cilk_for (long i = 0; i < size; ++i)
+      vals[i] = -(VAL)array[i];
+  } else {
+    algorithm = adaptive ? "adaptivesort" : sample ? "samplesort" : "cilksort";
+  }
 
   struct timeval t1, t2;
   gettimeofday(&t1, 0);
-  cilksort(array, tmp, size);
+  if (argsort_mode)
+    argsort(array, vals, size);
+  else if (stable)
+    stablesort(array, vals, size, &buf);
+  else if (kv)
+    cilksort_kv(array, tmp, vals, vtmp, size);
+  else if (adaptive)
+    adaptivesort(array, tmp, size);
+  else if (sample)
+    samplesort(array, tmp, size);
+  else
+    cilksort(array, tmp, size);
   gettimeofday(&t2, 0);
   unsigned long long runtime_ms = (todval(&t2) - todval(&t1)) / 1000;
   printf("%f\n", runtime_ms / 1000.0);
@@ -499,10 +2008,7 @@ int main(int argc, char **argv) {
   if (check) {
     printf("Now check result ... \n");
 
-    success = 1;
-    for (i = 0; i < size; ++i)
-      if (array[i] != i)
-        success = 0;
+    success = count_errors(array, vals, mode, size, 0, size) == 0;
 
     if (!success)
       fprintf(stderr, "SORTING FAILURE!");
@@ -510,11 +2016,31 @@ int main(int argc, char **argv) {
       fprintf(stderr, "Sorting successful.");
   }
 
+  if (argsort_mode || kv || stable) {
+    /* key-only baseline on the same input */
+    fill_array(array, size, seed);
+    order_array(array, size, order, seed);
+    gettimeofday(&t1, 0);
+    cilksort(array, tmp, size);
+    gettimeofday(&t2, 0);
+    unsigned long long keyonly_ms = (todval(&t2) - todval(&t1)) / 1000;
+    fprintf(stderr, "\nkey-only cilksort: %f s, %s / key-only = %.2f",
+            keyonly_ms / 1000.0, algorithm,
+            keyonly_ms ? (double)runtime_ms / keyonly_ms : 0.0);
+  }
+
   fprintf(stderr, "\nCilk Example: cilksort\n");
-  fprintf(stderr, "options: number of elements = %ld\n\n", size);
+  fprintf(stderr, "options: number of elements = %ld\n", size);
+  fprintf(stderr, "         algorithm = %s, input order = %s, seed = %ld\n",
+          algorithm, order, seed);
+  fprintf(stderr, "         leaf kernels = %s, %d-bit keys\n\n",
+          LEAF_KERNELS, ELM_BITS);
 
   free(array);
   free(tmp);
+  free(vals);
+  free(vtmp);
+  sort_buffer_release(&buf);
 
   return 0;
 }
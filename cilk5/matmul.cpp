@@ -0,0 +1,1781 @@
+/*
+ * Rectangular matrix multiplication.
+ *
+ * See the paper ``Cache-Oblivious Algorithms'', by
+ * Matteo Frigo, Charles E. Leiserson, Harald Prokop, and
+ * Sridhar Ramachandran, FOCS 1999, for an explanation of
+ * why this algorithm is good for caches.
+ *
+ * Author: Matteo Frigo
+ */
+
+/*
+ * Copyright (c) 2003 Massachusetts Institute of Technology
+ * Copyright (c) 2024 Tao B. Schardl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <cilk/cilk.h>
+#include <cilk/cilk_api.h>
+
+extern "C" {
+#include "getoptions.h"
+}
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <type_traits>
+
+#ifdef SERIAL
+#include <cilk/cilk_stub.h>
+#endif
+
+unsigned long long todval(struct timeval *tp) {
+  return tp->tv_sec * 1000 * 1000 + tp->tv_usec;
+}
+
+#ifndef RAND_MAX
+#define RAND_MAX 32767
+#endif
+
+unsigned long rand_nxt = 0;
+
+int cilk_rand(void) {
+  rand_nxt = rand_nxt * 1103515245 + 12345;
+  int result = (rand_nxt >> 16) % ((unsigned int)RAND_MAX + 1);
+  return result;
+}
+
+template <typename T> void zero_vec(T *V, int n) {
+
+  for (int i = 0; i < n; i++) {
+    V[i] = (T)0.0;
+  }
+}
+
+template <typename T> void init_vec(T *V, int n) {
+
+  for (int i = 0; i < n; i++) {
+    V[i] = (T)cilk_rand();
+  }
+}
+
+template <typename T> double maxerror_vec(T *V1, T *V2, long n) {
+  double err = 0.0;
+
+  for (long i = 0; i < n; i++) {
+    double diff = (V1[i] - V2[i]) / V1[i];
+    if (diff < 0)
+      diff = -diff;
+    if (diff > err) {
+      err = diff;
+    }
+  }
+
+  return err;
+}
+
+template <typename T> double sum_diff_vec(T *V1, T *V2, long n) {
+  double err = 0.0;
+
+  for (long i = 0; i < n; i++) {
+    double diff = (V1[i] - V2[i]) / V1[i];
+    if (diff < 0)
+      diff = -diff;
+    err += diff;
+  }
+
+  return err;
+}
+
+template <typename T> void print_vec(T *V, int n) {
+
+  for (int i = 0; i < n; i++) {
+    printf("%f  ", (double)V[i]);
+  }
+}
+
+template <typename T> void print_matrix(T *A, int m, int n, int ld) {
+
+  for (int i = 0; i < m; i++) {
+    for (int j = 0; j < n; j++) {
+      printf("%f  ", (double)A[i * ld + j]);
+    }
+    printf("\n");
+  }
+}
+
+template <typename T> void zero(T *A, int m, int n) {
+
+  for (int i = 0; i < m; i++) {
+    for (int j = 0; j < n; j++) {
+      A[i * n + j] = 0.0;
+    }
+  }
+}
+
+template <typename T> void init(T *A, int m, int n) {
+
+  for (int i = 0; i < m; i++) {
+    for (int j = 0; j < n; j++) {
+      A[i * n + j] = (double)cilk_rand();
+    }
+  }
+}
+
+template <typename T> double maxerror(T *A, T *B, int m, int n) {
+
+  double error = 0.0;
+
+  for (int i = 0; i < m; i++) {
+    for (int j = 0; j < n; j++) {
+      double diff = (A[i * n + j] - B[i * n + j]) / A[i * n + j];
+      if (diff < 0)
+        diff = -diff;
+      if (diff > error)
+        error = diff;
+    }
+  }
+
+  return error;
+}
+
+/*
+ * A row-major matrix operand of the multiply, seen through op(): element
+ * (i, j) of op(M) is M[i * ld + j], or M[j * ld + i] if trans is set.
+ */
+template <typename T> struct operand {
+  const T *M;
+  int ld;
+  bool trans;
+
+  const T &operator()(int i, int j) const {
+    return trans ? M[(long)j * ld + i] : M[(long)i * ld + j];
+  }
+  /* the submatrix of op(M) whose top left element is (i, j) */
+  operand block(int i, int j) const { return {&(*this)(i, j), ld, trans}; }
+};
+
+/*
+ * Low-precision inputs: bfloat16 and IEEE half precision numbers, kept as
+ * their bit patterns, and int8_t.  widen converts an input element to the
+ * type its products are accumulated in: float for bf16 and fp16, int32_t
+ * for int8_t.  to_bf16 and to_fp16 round a float to nearest even.
+ */
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+struct bf16 {
+  uint16_t bits;
+};
+struct fp16 {
+  uint16_t bits;
+};
+
+static inline uint32_t float_bits(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  return x;
+}
+
+static inline float bits_float(uint32_t x) {
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+template <typename T> inline T widen(T x) { return x; }
+inline int32_t widen(int8_t x) { return x; }
+inline float widen(bf16 x) { return bits_float((uint32_t)x.bits << 16); }
+
+inline float widen(fp16 x) {
+#ifdef __F16C__
+  return _cvtsh_ss(x.bits);
+#else
+  uint32_t sign = (uint32_t)(x.bits & 0x8000) << 16;
+  uint32_t exp = (x.bits >> 10) & 0x1f, man = x.bits & 0x3ff;
+  if (exp == 0) /* zero or subnormal */
+    return sign ? -ldexpf(man, -24) : ldexpf(man, -24);
+  if (exp == 31) /* infinity or NaN */
+    return bits_float(sign | 0x7f800000 | man << 13);
+  return bits_float(sign | (exp + 112) << 23 | man << 13);
+#endif
+}
+
+inline bf16 to_bf16(float f) {
+  uint32_t x = float_bits(f);
+  if ((x & 0x7fffffff) > 0x7f800000) /* keep NaNs quiet */
+    return {(uint16_t)(x >> 16 | 0x40)};
+  return {(uint16_t)((x + 0x7fff + ((x >> 16) & 1)) >> 16)};
+}
+
+inline fp16 to_fp16(float f) {
+#ifdef __F16C__
+  return {(uint16_t)_cvtss_sh(f, 0)};
+#else
+  uint32_t x = float_bits(f), sign = (x >> 16) & 0x8000;
+  x &= 0x7fffffff;
+  if (x > 0x7f800000) /* NaN */
+    return {(uint16_t)(sign | 0x7e00)};
+  if (x >= 0x477ff000) /* rounds past 65504 to infinity */
+    return {(uint16_t)(sign | 0x7c00)};
+  if (x < 0x38800000) /* subnormal: a multiple of 2^-24 */
+    return {(uint16_t)(sign | (uint32_t)nearbyintf(fabsf(f) * 0x1p24f))};
+  x -= 0x38000000; /* rebias the exponent from 127 to 15 */
+  return {(uint16_t)(sign | (x + 0xfff + ((x >> 13) & 1)) >> 13)};
+#endif
+}
+
+/* C = alpha * op(A) * op(B) + beta * C, the O(n^3) reference */
+template <typename T>
+void iter_matmul(operand<T> A, operand<T> B, T *C, int ldc, int m, int n,
+                 int p, T alpha, T beta) {
+
+  for (int i = 0; i < m; i++)
+    for (int k = 0; k < p; k++) {
+      T c = 0.0;
+      for (int j = 0; j < n; j++)
+        c += A(i, j) * B(j, k);
+      T old = beta == (T)0 ? (T)0 : beta * C[i * ldc + k];
+      C[i * ldc + k] = alpha * c + old;
+    }
+}
+
+/*
+ * Base case of the recursion: C = alpha * A * B, or C += alpha * A * B if
+ * add is set, for small m x n A and n x p B.
+ *
+ * With AVX2 or AVX-512, A and B are first packed into contiguous panels,
+ * BLIS style: A into slivers of MR rows stored column by column, B into
+ * slivers of NR columns stored row by row, both zero-padded.  Packing also
+ * applies the transposes and alpha.  A register-blocked micro-kernel then
+ * computes each MR x NR tile of C in 2 * MR vector accumulators, streaming
+ * both panels with unit stride instead of reading B down its columns.  The
+ * recursion stops at blocks of about BASE_SIZE / 3 on a side, which fit in
+ * the L2 cache once packed.  Without SIMD the base case is the naive
+ * triple loop.
+ */
+template <typename T> struct simd;
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define MATMUL_SIMD
+#define KERNEL_ISA "avx512"
+template <> struct simd<float> {
+  typedef __m512 vec;
+  static const int VLEN = 16;
+  static vec zero() { return _mm512_setzero_ps(); }
+  static vec load(const float *p) { return _mm512_loadu_ps(p); }
+  static void store(float *p, vec v) { _mm512_storeu_ps(p, v); }
+  static vec bcast(float x) { return _mm512_set1_ps(x); }
+  static vec add(vec a, vec b) { return _mm512_add_ps(a, b); }
+  static vec fma(vec a, vec b, vec c) { return _mm512_fmadd_ps(a, b, c); }
+  static float sum(vec v) { return _mm512_reduce_add_ps(v); }
+};
+template <> struct simd<double> {
+  typedef __m512d vec;
+  static const int VLEN = 8;
+  static vec zero() { return _mm512_setzero_pd(); }
+  static vec load(const double *p) { return _mm512_loadu_pd(p); }
+  static void store(double *p, vec v) { _mm512_storeu_pd(p, v); }
+  static vec bcast(double x) { return _mm512_set1_pd(x); }
+  static vec add(vec a, vec b) { return _mm512_add_pd(a, b); }
+  static vec fma(vec a, vec b, vec c) { return _mm512_fmadd_pd(a, b, c); }
+  static double sum(vec v) { return _mm512_reduce_add_pd(v); }
+};
+#elif defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define MATMUL_SIMD
+#define KERNEL_ISA "avx2"
+template <> struct simd<float> {
+  typedef __m256 vec;
+  static const int VLEN = 8;
+  static vec zero() { return _mm256_setzero_ps(); }
+  static vec load(const float *p) { return _mm256_loadu_ps(p); }
+  static void store(float *p, vec v) { _mm256_storeu_ps(p, v); }
+  static vec bcast(float x) { return _mm256_set1_ps(x); }
+  static vec add(vec a, vec b) { return _mm256_add_ps(a, b); }
+  static vec fma(vec a, vec b, vec c) { return _mm256_fmadd_ps(a, b, c); }
+  static float sum(vec v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+    s = _mm_hadd_ps(s, s);
+    return _mm_cvtss_f32(_mm_hadd_ps(s, s));
+  }
+};
+template <> struct simd<double> {
+  typedef __m256d vec;
+  static const int VLEN = 4;
+  static vec zero() { return _mm256_setzero_pd(); }
+  static vec load(const double *p) { return _mm256_loadu_pd(p); }
+  static void store(double *p, vec v) { _mm256_storeu_pd(p, v); }
+  static vec bcast(double x) { return _mm256_set1_pd(x); }
+  static vec add(vec a, vec b) { return _mm256_add_pd(a, b); }
+  static vec fma(vec a, vec b, vec c) { return _mm256_fmadd_pd(a, b, c); }
+  static double sum(vec v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v),
+                           _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_hadd_pd(s, s));
+  }
+};
+#else
+#define KERNEL_ISA "scalar"
+#endif
+
+#ifdef MATMUL_SIMD
+
+#define MR 6
+#define BASE_SIZE 400
+
+/*
+ * Scratch memory for the packed panels of the base case, one set per
+ * worker.  A base case does not spawn, so each worker runs one at a time
+ * and reuses its buffers, which grow to the largest leaf it has seen
+ * instead of being allocated and freed for every leaf.
+ */
+struct scratch {
+  void *mem = nullptr;
+  size_t size = 0;
+  ~scratch() { free(mem); }
+  template <typename U> U *get(long n) {
+    if (size < n * sizeof(U)) {
+      free(mem);
+      size = n * sizeof(U);
+      mem = malloc(size);
+    }
+    return (U *)mem;
+  }
+};
+static thread_local scratch panel_A, panel_B, panel_corr;
+
+/*
+ * pack alpha times the m x n block of A into slivers of MR rows, widening
+ * low-precision inputs to T
+ */
+template <typename T, typename In>
+static void pack_A(operand<In> A, int m, int n, T alpha, T *Ap) {
+
+  for (int i = 0; i < m; i += MR) {
+    if (i + MR <= m) {
+      for (int j = 0; j < n; j++)
+        for (int r = 0; r < MR; r++)
+          *Ap++ = alpha * (T)widen(A(i + r, j));
+    } else {
+      for (int j = 0; j < n; j++)
+        for (int r = 0; r < MR; r++)
+          *Ap++ = i + r < m ? alpha * (T)widen(A(i + r, j)) : (T)0.0;
+    }
+  }
+}
+
+/* pack the n x p block of B into slivers of NR columns, row by row */
+template <typename T, typename In>
+static void pack_B(operand<In> B, int n, int p, T *Bp) {
+
+  typedef simd<T> S;
+  const int NR = 2 * S::VLEN;
+
+  for (int k = 0; k < p; k += NR) {
+    if (std::is_same<T, In>::value && k + NR <= p && !B.trans) {
+      for (int j = 0; j < n; j++, Bp += NR) {
+        const T *b = (const T *)&B(j, k);
+        S::store(Bp, S::load(b));
+        S::store(Bp + S::VLEN, S::load(b + S::VLEN));
+      }
+    } else {
+      for (int j = 0; j < n; j++)
+        for (int c = 0; c < NR; c++)
+          *Bp++ = k + c < p ? (T)widen(B(j, k + c)) : (T)0.0;
+    }
+  }
+}
+
+/* the mr x nr (at most MR x NR) tile of C from a sliver of each panel */
+template <typename T>
+static void micro_kernel(int n, const T *Ap, const T *Bp, T *C, int ld,
+                         int mr, int nr, int add) {
+
+  typedef simd<T> S;
+  typedef typename S::vec vec;
+  const int VLEN = S::VLEN, NR = 2 * VLEN;
+  vec c[MR][2];
+
+  for (int r = 0; r < MR; r++)
+    c[r][0] = c[r][1] = S::zero();
+
+  for (int j = 0; j < n; j++) {
+    vec b0 = S::load(Bp + j * NR), b1 = S::load(Bp + j * NR + VLEN);
+    for (int r = 0; r < MR; r++) {
+      vec a = S::bcast(Ap[j * MR + r]);
+      c[r][0] = S::fma(a, b0, c[r][0]);
+      c[r][1] = S::fma(a, b1, c[r][1]);
+    }
+  }
+
+  if (mr == MR && nr == NR) {
+    for (int r = 0; r < MR; r++) {
+      T *row = C + r * ld;
+      if (add) {
+        c[r][0] = S::add(c[r][0], S::load(row));
+        c[r][1] = S::add(c[r][1], S::load(row + VLEN));
+      }
+      S::store(row, c[r][0]);
+      S::store(row + VLEN, c[r][1]);
+    }
+    return;
+  }
+
+  T tile[MR * NR];
+  for (int r = 0; r < MR; r++) {
+    S::store(tile + r * NR, c[r][0]);
+    S::store(tile + r * NR + VLEN, c[r][1]);
+  }
+  for (int r = 0; r < mr; r++)
+    for (int k = 0; k < nr; k++)
+      C[r * ld + k] = add ? C[r * ld + k] + tile[r * NR + k] : tile[r * NR + k];
+}
+
+template <typename T, typename In>
+static void base_matmul(operand<In> A, operand<In> B, T *C, int ldc, int m,
+                        int n, int p, T alpha, int add) {
+
+  const int NR = 2 * simd<T>::VLEN;
+  int mp = (m + MR - 1) / MR * MR, pp = (p + NR - 1) / NR * NR;
+  T *Ap = panel_A.get<T>((long)mp * n);
+  T *Bp = panel_B.get<T>((long)n * pp);
+
+  pack_A(A, m, n, alpha, Ap);
+  pack_B(B, n, p, Bp);
+  for (int k = 0; k < p; k += NR)
+    for (int i = 0; i < m; i += MR)
+      micro_kernel(n, Ap + i * n, Bp + k * n, C + i * ldc + k, ldc,
+                   m - i < MR ? m - i : MR, p - k < NR ? p - k : NR, add);
+}
+
+#endif
+
+/* the naive triple loop, accumulating in T */
+template <typename T, typename In>
+static void naive_matmul(operand<In> A, operand<In> B, T *C, int ldc, int m,
+                         int n, int p, T alpha, int add) {
+
+  for (int i = 0; i < m; i++)
+    for (int k = 0; k < p; k++) {
+      T c = 0;
+      for (int j = 0; j < n; j++)
+        c += (T)widen(A(i, j)) * (T)widen(B(j, k));
+      c *= alpha;
+      C[i * ldc + k] = add ? C[i * ldc + k] + c : c;
+    }
+}
+
+#ifdef MATMUL_SIMD
+/*
+ * Low-precision base cases.  fp16 inputs, and bf16 inputs without
+ * AVX512_BF16, are widened to float while packing and run through the
+ * float kernel above.  With AVX512_BF16, bf16 stays packed as pairs of
+ * consecutive k in 32-bit words: vdpbf16ps multiplies the pairs and adds
+ * both products to an fp32 accumulator, so each instruction does twice
+ * the multiply-adds of a float fma and the panels are half the size.
+ * int8_t inputs accumulate in int32_t.  With AVX512_VNNI they are packed
+ * in groups of four k for vpdpbusd, which multiplies unsigned by signed
+ * bytes: A is packed offset by 128, and 128 times the column sums of B is
+ * subtracted from the result.  int32_t sums are exact for n up to 65536.
+ */
+#if defined(__AVX512BF16__)
+#define PAIR_NR 32
+
+/* bits of element (i, j) of op(X), or 0 outside of its rows x cols */
+static inline uint32_t bf16_at(operand<bf16> X, int i, int j, int rows,
+                               int cols) {
+  return i < rows && j < cols ? X(i, j).bits : 0;
+}
+
+/* the mr x nr tile of C from slivers of nq packed pairs of bf16 */
+static void micro_kernel_bf16(int nq, const uint32_t *Ap, const uint32_t *Bp,
+                              float *C, int ld, int mr, int nr, float alpha,
+                              int add) {
+
+  __m512 c[MR][2];
+
+  for (int r = 0; r < MR; r++)
+    c[r][0] = c[r][1] = _mm512_setzero_ps();
+
+  for (int q = 0; q < nq; q++) {
+    __m512bh b0 = (__m512bh)_mm512_loadu_si512(Bp + q * PAIR_NR);
+    __m512bh b1 = (__m512bh)_mm512_loadu_si512(Bp + q * PAIR_NR + 16);
+    for (int r = 0; r < MR; r++) {
+      __m512bh a = (__m512bh)_mm512_set1_epi32(Ap[q * MR + r]);
+      c[r][0] = _mm512_dpbf16_ps(c[r][0], a, b0);
+      c[r][1] = _mm512_dpbf16_ps(c[r][1], a, b1);
+    }
+  }
+
+  __m512 va = _mm512_set1_ps(alpha);
+  if (mr == MR && nr == PAIR_NR) {
+    for (int r = 0; r < MR; r++) {
+      float *row = C + r * ld;
+      c[r][0] = _mm512_mul_ps(va, c[r][0]);
+      c[r][1] = _mm512_mul_ps(va, c[r][1]);
+      if (add) {
+        c[r][0] = _mm512_add_ps(c[r][0], _mm512_loadu_ps(row));
+        c[r][1] = _mm512_add_ps(c[r][1], _mm512_loadu_ps(row + 16));
+      }
+      _mm512_storeu_ps(row, c[r][0]);
+      _mm512_storeu_ps(row + 16, c[r][1]);
+    }
+    return;
+  }
+
+  float tile[MR * PAIR_NR];
+  for (int r = 0; r < MR; r++) {
+    _mm512_storeu_ps(tile + r * PAIR_NR, _mm512_mul_ps(va, c[r][0]));
+    _mm512_storeu_ps(tile + r * PAIR_NR + 16, _mm512_mul_ps(va, c[r][1]));
+  }
+  for (int r = 0; r < mr; r++)
+    for (int k = 0; k < nr; k++)
+      C[r * ld + k] = add ? C[r * ld + k] + tile[r * PAIR_NR + k]
+                          : tile[r * PAIR_NR + k];
+}
+
+static void base_matmul(operand<bf16> A, operand<bf16> B, float *C, int ldc,
+                        int m, int n, int p, float alpha, int add) {
+
+  const int NR = PAIR_NR, nq = (n + 1) / 2;
+  int mp = (m + MR - 1) / MR * MR, pp = (p + NR - 1) / NR * NR;
+  uint32_t *Ap = panel_A.get<uint32_t>((long)mp * nq);
+  uint32_t *Bp = panel_B.get<uint32_t>((long)nq * pp);
+  uint32_t *a = Ap, *b = Bp;
+
+  for (int i = 0; i < m; i += MR)
+    for (int q = 0; q < nq; q++)
+      for (int r = 0; r < MR; r++, a++)
+        if (!A.trans && i + r < m && 2 * q + 1 < n)
+          memcpy(a, &A(i + r, 2 * q), sizeof(*a)); /* a stored pair */
+        else
+          *a = bf16_at(A, i + r, 2 * q, m, n) |
+               bf16_at(A, i + r, 2 * q + 1, m, n) << 16;
+  for (int k = 0; k < p; k += NR)
+    for (int q = 0; q < nq; q++) {
+      if (!B.trans && k + NR <= p && 2 * q + 1 < n) {
+        const bf16 *b0 = &B(2 * q, k), *b1 = &B(2 * q + 1, k);
+        for (int c = 0; c < NR; c++)
+          *b++ = b0[c].bits | (uint32_t)b1[c].bits << 16;
+      } else {
+        for (int c = 0; c < NR; c++)
+          *b++ = bf16_at(B, 2 * q, k + c, n, p) |
+                 bf16_at(B, 2 * q + 1, k + c, n, p) << 16;
+      }
+    }
+
+  for (int k = 0; k < p; k += NR)
+    for (int i = 0; i < m; i += MR)
+      micro_kernel_bf16(nq, Ap + i * nq, Bp + k * nq, C + i * ldc + k, ldc,
+                        m - i < MR ? m - i : MR, p - k < NR ? p - k : NR,
+                        alpha, add);
+}
+#endif
+
+#if defined(__AVX512VNNI__)
+#define QUAD_NR 32
+
+/* the mr x nr tile of C from slivers of nq packed quads of int8_t */
+static void micro_kernel_i8(int nq, const uint32_t *Ap, const uint32_t *Bp,
+                            const int32_t *corr, int32_t *C, int ld, int mr,
+                            int nr, int32_t alpha, int add) {
+
+  __m512i c[MR][2];
+
+  for (int r = 0; r < MR; r++)
+    c[r][0] = c[r][1] = _mm512_setzero_si512();
+
+  for (int q = 0; q < nq; q++) {
+    __m512i b0 = _mm512_loadu_si512(Bp + q * QUAD_NR);
+    __m512i b1 = _mm512_loadu_si512(Bp + q * QUAD_NR + 16);
+    for (int r = 0; r < MR; r++) {
+      __m512i a = _mm512_set1_epi32(Ap[q * MR + r]);
+      c[r][0] = _mm512_dpbusd_epi32(c[r][0], a, b0);
+      c[r][1] = _mm512_dpbusd_epi32(c[r][1], a, b1);
+    }
+  }
+
+  __m512i va = _mm512_set1_epi32(alpha);
+  if (mr == MR && nr == QUAD_NR) {
+    __m512i k0 = _mm512_loadu_si512(corr), k1 = _mm512_loadu_si512(corr + 16);
+    for (int r = 0; r < MR; r++) {
+      int32_t *row = C + r * ld;
+      c[r][0] = _mm512_mullo_epi32(va, _mm512_sub_epi32(c[r][0], k0));
+      c[r][1] = _mm512_mullo_epi32(va, _mm512_sub_epi32(c[r][1], k1));
+      if (add) {
+        c[r][0] = _mm512_add_epi32(c[r][0], _mm512_loadu_si512(row));
+        c[r][1] = _mm512_add_epi32(c[r][1], _mm512_loadu_si512(row + 16));
+      }
+      _mm512_storeu_si512(row, c[r][0]);
+      _mm512_storeu_si512(row + 16, c[r][1]);
+    }
+    return;
+  }
+
+  int32_t tile[MR * QUAD_NR];
+  for (int r = 0; r < MR; r++) {
+    _mm512_storeu_si512(tile + r * QUAD_NR, c[r][0]);
+    _mm512_storeu_si512(tile + r * QUAD_NR + 16, c[r][1]);
+  }
+  for (int r = 0; r < mr; r++)
+    for (int k = 0; k < nr; k++) {
+      int32_t v = alpha * (tile[r * QUAD_NR + k] - corr[k]);
+      C[r * ld + k] = add ? C[r * ld + k] + v : v;
+    }
+}
+
+/* four elements of row i of op(X) from column j on, as bytes plus offset */
+static inline uint32_t i8_quad(operand<int8_t> X, int i, int j, int rows,
+                               int cols, int offset) {
+  uint32_t w = 0;
+  for (int t = 0; t < 4; t++)
+    if (i < rows && j + t < cols)
+      w |= (uint32_t)(uint8_t)(X(i, j + t) + offset) << 8 * t;
+  return w;
+}
+
+static void base_matmul(operand<int8_t> A, operand<int8_t> B, int32_t *C,
+                        int ldc, int m, int n, int p, int32_t alpha,
+                        int add) {
+
+  const int NR = QUAD_NR, nq = (n + 3) / 4;
+  int mp = (m + MR - 1) / MR * MR, pp = (p + NR - 1) / NR * NR;
+  uint32_t *Ap = panel_A.get<uint32_t>((long)mp * nq);
+  uint32_t *Bp = panel_B.get<uint32_t>((long)nq * pp);
+  int32_t *corr = panel_corr.get<int32_t>(pp);
+  uint32_t *a = Ap, *b = Bp;
+  operand<int8_t> Bt = {B.M, B.ld, !B.trans}; /* rows of Bt are columns */
+
+  for (int i = 0; i < m; i += MR)
+    for (int q = 0; q < nq; q++)
+      for (int r = 0; r < MR; r++, a++)
+        if (!A.trans && i + r < m && 4 * q + 3 < n) {
+          memcpy(a, &A(i + r, 4 * q), sizeof(*a)); /* a stored quad */
+          *a ^= 0x80808080; /* adds 128 to each byte */
+        } else {
+          *a = i8_quad(A, i + r, 4 * q, m, n, 128);
+        }
+  for (int k = 0; k < p; k += NR)
+    for (int q = 0; q < nq; q++) {
+      if (!B.trans && k + NR <= p && 4 * q + 3 < n) {
+        const uint8_t *b0 = (const uint8_t *)&B(4 * q, k);
+        for (int c = 0; c < NR; c++)
+          *b++ = b0[c] | b0[B.ld + c] << 8 | b0[2 * B.ld + c] << 16 |
+                 (uint32_t)b0[3 * B.ld + c] << 24;
+      } else {
+        for (int c = 0; c < NR; c++)
+          *b++ = i8_quad(Bt, k + c, 4 * q, p, n, 0);
+      }
+    }
+  memset(corr, 0, pp * sizeof(int32_t));
+  for (int j = 0; j < n; j++)
+    for (int k = 0; k < p; k++)
+      corr[k] += 128 * B(j, k);
+
+  for (int k = 0; k < p; k += NR)
+    for (int i = 0; i < m; i += MR)
+      micro_kernel_i8(nq, Ap + i * nq, Bp + k * nq, corr + k,
+                      C + i * ldc + k, ldc, m - i < MR ? m - i : MR,
+                      p - k < NR ? p - k : NR, alpha, add);
+}
+#else
+/*
+ * Portable int8_t base case: copy op(B) into a row-major block, then
+ * accumulate each row of C as a sum of rows of B scaled by elements of A,
+ * which the compiler vectorizes with int32_t lanes.
+ */
+static void base_matmul(operand<int8_t> A, operand<int8_t> B, int32_t *C,
+                        int ldc, int m, int n, int p, int32_t alpha,
+                        int add) {
+
+  int8_t *Bp = panel_B.get<int8_t>((long)n * p);
+  int32_t *row = panel_A.get<int32_t>(p);
+
+  for (int j = 0; j < n; j++)
+    for (int k = 0; k < p; k++)
+      Bp[j * p + k] = B(j, k);
+  for (int i = 0; i < m; i++) {
+    for (int k = 0; k < p; k++)
+      row[k] = 0;
+    for (int j = 0; j < n; j++) {
+      int32_t aij = A(i, j);
+      const int8_t *bj = Bp + j * p;
+      for (int k = 0; k < p; k++)
+        row[k] += aij * bj[k];
+    }
+    for (int k = 0; k < p; k++)
+      C[i * ldc + k] = add ? C[i * ldc + k] + alpha * row[k] : alpha * row[k];
+  }
+}
+#endif
+#else
+
+#define BASE_SIZE 64
+
+template <typename T, typename In>
+static void base_matmul(operand<In> A, operand<In> B, T *C, int ldc, int m,
+                        int n, int p, T alpha, int add) {
+  naive_matmul(A, B, C, ldc, m, n, p, alpha, add);
+}
+
+#endif
+
+/*
+ * Measure the floating-point throughput of one worker in flop/s, running
+ * independent chains of the kernel's multiply-adds on registers only.
+ */
+template <typename T> double peak_flops(void) {
+
+  const long iters = 1 << 24;
+  struct timeval t1, t2;
+  volatile T sink;
+
+#ifdef MATMUL_SIMD
+  typedef simd<T> S;
+  typename S::vec acc[12], x = S::bcast((T)0.999999), y = S::bcast((T)1e-6);
+  for (int i = 0; i < 12; i++)
+    acc[i] = S::bcast((T)i);
+  gettimeofday(&t1, 0);
+  for (long t = 0; t < iters; t++)
+    for (int i = 0; i < 12; i++)
+      acc[i] = S::fma(acc[i], x, y);
+  gettimeofday(&t2, 0);
+  for (int i = 1; i < 12; i++)
+    acc[0] = S::add(acc[0], acc[i]);
+  T out[S::VLEN];
+  S::store(out, acc[0]);
+  sink = out[0];
+  double flops = 2.0 * 12 * S::VLEN * iters;
+#else
+  T acc[12], x = (T)0.999999, y = (T)1e-6;
+  for (int i = 0; i < 12; i++)
+    acc[i] = (T)i;
+  gettimeofday(&t1, 0);
+  for (long t = 0; t < iters; t++)
+    for (int i = 0; i < 12; i++)
+      acc[i] = acc[i] * x + y;
+  gettimeofday(&t2, 0);
+  for (int i = 1; i < 12; i++)
+    acc[0] += acc[i];
+  sink = acc[0];
+  double flops = 2.0 * 12 * iters;
+#endif
+  (void)sink;
+
+  return flops / ((todval(&t2) - todval(&t1)) / 1000000.0);
+}
+
+/*
+ * Splitting the inner dimension n is the only way to find parallelism in
+ * products with a small output and a large n.  Such splits compute the
+ * second half into a temporary, which is added into C after the sync.  A
+ * split happens only when n >= max(m, p), so the extra addition costs at
+ * most 1 / (2 max(m, p)) of the multiply; temporaries are limited to
+ * outputs of at most KSPLIT_MAX_OUTPUT elements, and products of fewer
+ * than KSPLIT_MIN_WORK multiply-adds split serially, as there is enough
+ * parallelism above them.  If parallel_ksplit is cleared, all inner splits
+ * run one half after the other into C as before.
+ */
+#define KSPLIT_MAX_OUTPUT (1L << 20)
+#define KSPLIT_MIN_WORK (1L << 24)
+
+bool parallel_ksplit = true;
+
+template <typename T, typename In>
+void rec_matmul(operand<In> A, operand<In> B, T *C, int ldc, int m, int n,
+                int p, T alpha);
+
+template <typename T, typename In>
+void rec_matmulAdd(operand<In> A, operand<In> B, T *C, int ldc, int m, int n,
+                   int p, T alpha);
+
+/* C = alpha * A * B, or C += alpha * A * B if add is set, splitting n */
+template <typename T, typename In>
+void rec_matmul_ksplit(operand<In> A, operand<In> B, T *C, int ldc, int m,
+                       int n, int p, T alpha, int add) {
+
+  int n1 = n >> 1;
+
+  if (!parallel_ksplit || (long)m * p > KSPLIT_MAX_OUTPUT ||
+      (long)m * n * p < KSPLIT_MIN_WORK) {
+    if (add)
+      rec_matmulAdd(A, B, C, ldc, m, n1, p, alpha);
+    else
+      rec_matmul(A, B, C, ldc, m, n1, p, alpha);
+    rec_matmulAdd(A.block(0, n1), B.block(n1, 0), C, ldc, m, n - n1, p,
+                  alpha);
+    return;
+  }
+
+  T *tmp = (T *)malloc((long)m * p * sizeof(T));
+  cilk_scope {
+    if (add)
+      cilk_spawn rec_matmulAdd(A, B, C, ldc, m, n1, p, alpha);
+    else
+      cilk_spawn rec_matmul(A, B, C, ldc, m, n1, p, alpha);
+    rec_matmul(A.block(0, n1), B.block(n1, 0), tmp, p, m, n - n1, p, alpha);
+  }
+  cilk_for (int i = 0; i < m; i++)
+    for (int k = 0; k < p; k++)
+      C[i * ldc + k] += tmp[i * p + k];
+  free(tmp);
+}
+
+/*
+ * C += alpha * A * B, where
+ * A \in M(m, n)
+ * B \in M(n, p)
+ * C \in M(m, p)
+ */
+template <typename T, typename In>
+void rec_matmulAdd(operand<In> A, operand<In> B, T *C, int ldc, int m, int n,
+                   int p, T alpha) {
+
+  if ((m + n + p) <= BASE_SIZE) {
+    base_matmul(A, B, C, ldc, m, n, p, alpha, 1);
+    return;
+  }
+
+  if (n >= p) {
+    if (m >= n) {
+      int m1 = m >> 1;
+
+      cilk_scope {
+        cilk_spawn rec_matmulAdd(A, B, C, ldc, m1, n, p, alpha);
+        rec_matmulAdd(A.block(m1, 0), B, C + m1 * ldc, ldc, m - m1, n, p,
+                      alpha);
+      }
+      return;
+    } else {
+      rec_matmul_ksplit(A, B, C, ldc, m, n, p, alpha, 1);
+      return;
+    }
+  } else {
+    int p1 = p >> 1;
+    cilk_scope {
+      cilk_spawn rec_matmulAdd(A, B, C, ldc, m, n, p1, alpha);
+      rec_matmulAdd(A, B.block(0, p1), C + p1, ldc, m, n, p - p1, alpha);
+    }
+    return;
+  }
+}
+
+/* C = alpha * A * B */
+template <typename T, typename In>
+void rec_matmul(operand<In> A, operand<In> B, T *C, int ldc, int m, int n,
+                int p, T alpha) {
+
+  if ((m + n + p) <= BASE_SIZE) {
+    base_matmul(A, B, C, ldc, m, n, p, alpha, 0);
+    return;
+  }
+
+  if (n >= p) {
+    if (m >= n) {
+      int m1 = m >> 1;
+      cilk_scope {
+        cilk_spawn rec_matmul(A, B, C, ldc, m1, n, p, alpha);
+        rec_matmul(A.block(m1, 0), B, C + m1 * ldc, ldc, m - m1, n, p, alpha);
+        return;
+      }
+    } else {
+      rec_matmul_ksplit(A, B, C, ldc, m, n, p, alpha, 0);
+      return;
+    }
+  } else {
+    int p1 = p >> 1;
+    cilk_scope {
+      cilk_spawn rec_matmul(A, B, C, ldc, m, n, p1, alpha);
+      rec_matmul(A, B.block(0, p1), C + p1, ldc, m, n, p - p1, alpha);
+      return;
+    }
+  }
+}
+
+/*
+ * General matrix multiply: C = alpha * op(A) * op(B) + beta * C, where
+ * op(A) is m x n, op(B) is n x p, C is m x p, and op(X) is X, or its
+ * transpose if transX is set.  All matrices are row-major with leading
+ * dimensions lda, ldb and ldc.  As in BLAS, C is not read if beta is 0.
+ * A and B are either of the type T of C, or low-precision inputs whose
+ * products are accumulated in T: bf16 or fp16 with float C, or int8_t
+ * with int32_t C.
+ */
+template <typename In, typename T>
+void gemm(bool transA, bool transB, int m, int n, int p, T alpha, const In *A,
+          int lda, const In *B, int ldb, T beta, T *C, int ldc) {
+
+  operand<In> opA = {A, lda, transA}, opB = {B, ldb, transB};
+
+  if (beta == (T)0) {
+    rec_matmul(opA, opB, C, ldc, m, n, p, alpha);
+    return;
+  }
+  if (beta != (T)1)
+    cilk_for (int i = 0; i < m; i++)
+      for (int k = 0; k < p; k++)
+        C[(long)i * ldc + k] *= beta;
+  rec_matmulAdd(opA, opB, C, ldc, m, n, p, alpha);
+}
+
+/*
+ * Batched multiply of small matrices: C_b = alpha * A_b * B_b + beta * C_b
+ * for b < batch, where each A_b is m x n, B_b is n x p and C_b is m x p,
+ * all row-major and stored one after the other.  The parallelism is
+ * across the batch.  Common square sizes get serial kernels with their
+ * dimensions fixed at compile time, so matrices of a few dozen on a side
+ * do not pay for the recursion, its spawns and the packing of the base
+ * case; other sizes run gemm on each product.  The kernels accumulate rows
+ * of C as sums of rows of B.  With SIMD, when a row of C is a whole
+ * number of vectors, they keep a block of rows of C in registers, as many
+ * as fit, and multiply it by B one row of B at a time.
+ */
+constexpr int row_block(int m, int max) {
+  return m <= max ? m : row_block(m / 2, max);
+}
+
+template <int M, int N, int P, typename T>
+static void small_matmul(const T *A, const T *B, T *C, T alpha, T beta) {
+
+#ifdef MATMUL_SIMD
+  typedef simd<T> S;
+  typedef typename S::vec vec;
+  const int VLEN = S::VLEN, NV = P / VLEN > 0 ? P / VLEN : 1;
+  /* accumulators: AVX-512 has 32 vector registers, AVX2 16 */
+  const int ACC = sizeof(vec) == 64 ? 24 : 12;
+  const int MI = row_block(M, ACC / NV > 0 ? ACC / NV : 1);
+
+  if (P % VLEN == 0 && M % MI == 0) {
+    vec va = S::bcast(alpha), vb = S::bcast(beta);
+    for (int i = 0; i < M; i += MI) {
+      vec c[MI][NV];
+      for (int r = 0; r < MI; r++)
+        for (int v = 0; v < NV; v++)
+          c[r][v] = S::zero();
+      for (int j = 0; j < N; j++) {
+        vec b[NV];
+        for (int v = 0; v < NV; v++)
+          b[v] = S::load(B + j * P + v * VLEN);
+        for (int r = 0; r < MI; r++) {
+          vec a = S::bcast(A[(i + r) * N + j]);
+          for (int v = 0; v < NV; v++)
+            c[r][v] = S::fma(a, b[v], c[r][v]);
+        }
+      }
+      for (int r = 0; r < MI; r++)
+        for (int v = 0; v < NV; v++) {
+          T *row = C + (i + r) * P + v * VLEN;
+          vec old = beta == (T)0 ? S::zero()
+                                 : S::fma(vb, S::load(row), S::zero());
+          S::store(row, S::fma(va, c[r][v], old));
+        }
+    }
+    return;
+  }
+#endif
+
+  for (int i = 0; i < M; i++) {
+    T c[P];
+    for (int k = 0; k < P; k++)
+      c[k] = 0;
+    for (int j = 0; j < N; j++) {
+      T a = A[i * N + j];
+      for (int k = 0; k < P; k++)
+        c[k] += a * B[j * P + k];
+    }
+    T *row = C + i * P;
+    if (beta == (T)0)
+      for (int k = 0; k < P; k++)
+        row[k] = alpha * c[k];
+    else
+      for (int k = 0; k < P; k++)
+        row[k] = alpha * c[k] + beta * row[k];
+  }
+}
+
+template <typename T>
+void gemm_batched(int batch, int m, int n, int p, T alpha, const T *A,
+                  const T *B, T beta, T *C) {
+
+  long sa = (long)m * n, sb = (long)n * p, sc = (long)m * p;
+  void (*kernel)(const T *, const T *, T *, T, T) = NULL;
+
+  if (m == n && n == p) {
+    switch (n) {
+    case 4:
+      kernel = small_matmul<4, 4, 4, T>;
+      break;
+    case 8:
+      kernel = small_matmul<8, 8, 8, T>;
+      break;
+    case 16:
+      kernel = small_matmul<16, 16, 16, T>;
+      break;
+    case 32:
+      kernel = small_matmul<32, 32, 32, T>;
+      break;
+    case 64:
+      kernel = small_matmul<64, 64, 64, T>;
+      break;
+    }
+  }
+
+  if (kernel)
+    cilk_for (int b = 0; b < batch; b++)
+      kernel(A + b * sa, B + b * sb, C + b * sc, alpha, beta);
+  else
+    cilk_for (int b = 0; b < batch; b++)
+      gemm(false, false, m, n, p, alpha, A + b * sa, n, B + b * sb, p, beta,
+           C + b * sc, p);
+}
+
+/*
+ * Morton layout.  An n x n matrix is padded with zeros to s x s tiles of
+ * edge t, s a power of 2, and the tiles are stored one after the other in
+ * Z order, each of them row-major.  Every aligned square of tiles whose
+ * edge is a power of 2 is then contiguous, so the quadrants the recursion
+ * descends into stay within as few pages as their size allows, whereas a
+ * row-major quadrant of an n x n matrix touches a page for each of its
+ * rows.  morton_tile picks t between MORTON_TILE / 2 and MORTON_TILE, a
+ * multiple of 16 so that the rows of a tile are whole vectors.
+ */
+#define MORTON_TILE 128
+
+/* the number of tiles on a side of the Morton layout of an n x n matrix */
+int morton_tiles(int n) {
+
+  int s = 1;
+
+  while ((long)s * MORTON_TILE < n)
+    s *= 2;
+  return s;
+}
+
+/* the edge of the tiles of the Morton layout of an n x n matrix */
+int morton_tile(int n) {
+
+  int s = morton_tiles(n);
+
+  return ((n + s - 1) / s + 15) / 16 * 16;
+}
+
+/* interleave the bits of i and j, those of i going to the odd bits */
+long interleave(int i, int j) {
+
+  long z = 0;
+
+  for (int b = 0; (1 << b) <= (i | j); b++)
+    z |= (long)((i >> b) & 1) << (2 * b + 1) |
+         (long)((j >> b) & 1) << (2 * b);
+  return z;
+}
+
+/* copy row-major n x n M into the Morton layout Z */
+template <typename T> void to_morton(const T *M, int n, int ld, T *Z) {
+
+  int s = morton_tiles(n), t = morton_tile(n);
+
+  cilk_for (int b = 0; b < s * s; b++) {
+    int i0 = b / s * t, j0 = b % s * t;
+    int len = n - j0 < t ? (n - j0 > 0 ? n - j0 : 0) : t;
+    T *z = Z + interleave(b / s, b % s) * t * t;
+    for (int i = 0; i < t; i++) {
+      int l = i0 + i < n ? len : 0;
+      if (l > 0)
+        memcpy(z + i * t, M + (long)(i0 + i) * ld + j0, l * sizeof(T));
+      memset(z + i * t + l, 0, (t - l) * sizeof(T));
+    }
+  }
+}
+
+/* copy the n x n matrix in the Morton layout Z back into row-major M */
+template <typename T> void from_morton(const T *Z, int n, T *M, int ld) {
+
+  int s = morton_tiles(n), t = morton_tile(n);
+
+  cilk_for (int b = 0; b < s * s; b++) {
+    int i0 = b / s * t, j0 = b % s * t;
+    int len = n - j0 < t ? n - j0 : t;
+    const T *z = Z + interleave(b / s, b % s) * t * t;
+    for (int i = 0; i < t && i0 + i < n && len > 0; i++)
+      memcpy(M + (long)(i0 + i) * ld + j0, z + i * t, len * sizeof(T));
+  }
+}
+
+/*
+ * C = alpha * A * B, or C += alpha * A * B if add is set, for s x s
+ * tiles of edge t in the Morton layout.  The quadrants of the operands are
+ * contiguous, so each level multiplies them in two rounds of four
+ * independent products, and a single tile goes to the row-major
+ * recursion.
+ */
+template <typename T>
+void rec_matmul_z(const T *A, const T *B, T *C, int s, int t, T alpha,
+                  int add) {
+
+  if (s == 1) {
+    operand<T> opA = {A, t, false}, opB = {B, t, false};
+    if (add)
+      rec_matmulAdd(opA, opB, C, t, t, t, t, alpha);
+    else
+      rec_matmul(opA, opB, C, t, t, t, t, alpha);
+    return;
+  }
+
+  long q = (long)(s / 2) * (s / 2) * t * t; /* elements per quadrant */
+
+  cilk_scope {
+    cilk_spawn rec_matmul_z(A, B, C, s / 2, t, alpha, add);
+    cilk_spawn rec_matmul_z(A, B + q, C + q, s / 2, t, alpha, add);
+    cilk_spawn rec_matmul_z(A + 2 * q, B, C + 2 * q, s / 2, t, alpha, add);
+    rec_matmul_z(A + 2 * q, B + q, C + 3 * q, s / 2, t, alpha, add);
+  }
+  cilk_scope {
+    cilk_spawn rec_matmul_z(A + q, B + 2 * q, C, s / 2, t, alpha, 1);
+    cilk_spawn rec_matmul_z(A + q, B + 3 * q, C + q, s / 2, t, alpha, 1);
+    cilk_spawn rec_matmul_z(A + 3 * q, B + 2 * q, C + 2 * q, s / 2, t, alpha,
+                            1);
+    rec_matmul_z(A + 3 * q, B + 3 * q, C + 3 * q, s / 2, t, alpha, 1);
+  }
+}
+
+/*
+ * Matrix-vector multiply.
+ *
+ * rec_gemv computes y = alpha * A * x, or y += alpha * A * x if add is
+ * set, for m x n A, splitting like the old mat_vec_mul: the rows of A in
+ * parallel when m >= n, and otherwise its columns, computing the second
+ * half of y into a temporary that is added in after the sync.  Blocks of
+ * at most GEMV_BASE elements go to a kernel that takes each row of A
+ * (rows of A^T are columns of the stored matrix) as a dot product with x,
+ * four rows at a time, or, for transposed A, adds alpha * x[j] times each
+ * stored row j into a strip of y held in registers.  Either way the matrix
+ * is streamed once with unit stride, so GEMV runs at memory bandwidth.
+ */
+#define GEMV_BASE (1 << 15)
+
+#ifdef MATMUL_SIMD
+
+template <typename T>
+static void gemv_kernel(operand<T> A, const T *x, T *y, int m, int n,
+                        T alpha, int add) {
+
+  typedef simd<T> S;
+  typedef typename S::vec vec;
+  const int VLEN = S::VLEN;
+  int i = 0;
+
+  if (A.trans) {
+    for (; i + 4 * VLEN <= m; i += 4 * VLEN) {
+      vec c[4];
+      for (int r = 0; r < 4; r++)
+        c[r] = add ? S::load(y + i + r * VLEN) : S::zero();
+      for (int j = 0; j < n; j++) {
+        vec a = S::bcast(alpha * x[j]);
+        const T *row = &A(i, j);
+        for (int r = 0; r < 4; r++)
+          c[r] = S::fma(a, S::load(row + r * VLEN), c[r]);
+      }
+      for (int r = 0; r < 4; r++)
+        S::store(y + i + r * VLEN, c[r]);
+    }
+    for (; i < m; i++) {
+      T c = 0;
+      for (int j = 0; j < n; j++)
+        c += A(i, j) * x[j];
+      y[i] = add ? y[i] + alpha * c : alpha * c;
+    }
+    return;
+  }
+
+  for (; i + 4 <= m; i += 4) {
+    const T *row[4] = {&A(i, 0), &A(i + 1, 0), &A(i + 2, 0), &A(i + 3, 0)};
+    vec c[4] = {S::zero(), S::zero(), S::zero(), S::zero()};
+    int j = 0;
+    for (; j + VLEN <= n; j += VLEN) {
+      vec xv = S::load(x + j);
+      for (int r = 0; r < 4; r++)
+        c[r] = S::fma(S::load(row[r] + j), xv, c[r]);
+    }
+    for (int r = 0; r < 4; r++) {
+      T d = S::sum(c[r]);
+      for (int k = j; k < n; k++)
+        d += row[r][k] * x[k];
+      y[i + r] = add ? y[i + r] + alpha * d : alpha * d;
+    }
+  }
+  for (; i < m; i++) {
+    const T *row = &A(i, 0);
+    vec c = S::zero();
+    int j = 0;
+    for (; j + VLEN <= n; j += VLEN)
+      c = S::fma(S::load(row + j), S::load(x + j), c);
+    T d = S::sum(c);
+    for (; j < n; j++)
+      d += row[j] * x[j];
+    y[i] = add ? y[i] + alpha * d : alpha * d;
+  }
+}
+
+#else
+
+template <typename T>
+static void gemv_kernel(operand<T> A, const T *x, T *y, int m, int n,
+                        T alpha, int add) {
+
+  for (int i = 0; i < m; i++) {
+    T c = 0;
+    for (int j = 0; j < n; j++)
+      c += A(i, j) * x[j];
+    y[i] = add ? y[i] + alpha * c : alpha * c;
+  }
+}
+
+#endif
+
+template <typename T>
+void rec_gemv(operand<T> A, const T *x, T *y, int m, int n, T alpha,
+              int add) {
+
+  if ((long)m * n <= GEMV_BASE) {
+    gemv_kernel(A, x, y, m, n, alpha, add);
+    return;
+  }
+
+  if (m >= n) { // cut m dimension
+    int m1 = m >> 1;
+    cilk_scope {
+      cilk_spawn rec_gemv(A, x, y, m1, n, alpha, add);
+      rec_gemv(A.block(m1, 0), x, y + m1, m - m1, n, alpha, add);
+    }
+  } else { // cut n dimension
+    int n1 = n >> 1;
+    T *tmp = (T *)malloc(m * sizeof(T));
+    cilk_scope {
+      cilk_spawn rec_gemv(A, x, y, m, n1, alpha, add);
+      rec_gemv(A.block(0, n1), x + n1, tmp, m, n - n1, alpha, 0);
+    }
+    for (int i = 0; i < m; i++)
+      y[i] += tmp[i];
+    free(tmp);
+  }
+}
+
+/*
+ * General matrix-vector multiply: y = alpha * op(A) * x + beta * y, where
+ * op(A) is m x n and op(A) is A, or its transpose if transA is set.  A is
+ * row-major with leading dimension lda.  y is not read if beta is 0.
+ */
+template <typename T>
+void gemv(bool transA, int m, int n, T alpha, const T *A, int lda,
+          const T *x, T beta, T *y) {
+
+  operand<T> opA = {A, lda, transA};
+
+  if (beta == (T)0) {
+    rec_gemv(opA, x, y, m, n, alpha, 0);
+    return;
+  }
+  if (beta != (T)1)
+    cilk_for (int i = 0; i < m; i++)
+      y[i] *= beta;
+  rec_gemv(opA, x, y, m, n, alpha, 1);
+}
+
+/*
+ * Multiply a random m x n op(A) by a random n x p op(B) into a random
+ * m x p C with gemm, time it, and optionally check the result.
+ */
+template <typename T>
+int run(int m, int n, int p, int transA, int transB, T alpha, T beta,
+        int check, int rand_check) {
+
+  int lda = transA ? m : n, ldb = transB ? n : p, ldc = p;
+  T *A = (T *)malloc((long)m * n * sizeof(T));
+  T *B = (T *)malloc((long)n * p * sizeof(T));
+  T *C = (T *)malloc((long)m * p * sizeof(T));
+  T *C0 = NULL;
+  double err;
+
+  init(A, transA ? n : m, lda);
+  init(B, transB ? p : n, ldb);
+  if (beta == (T)0) {
+    zero(C, m, p);
+  } else {
+    init(C, m, p);
+  }
+  if (check || rand_check) {
+    C0 = (T *)malloc((long)m * p * sizeof(T));
+    memcpy(C0, C, (long)m * p * sizeof(T));
+  }
+
+  fprintf(stderr,
+          "\nCalculate using recursive method ... (timing start here)\n");
+
+  struct timeval t1, t2;
+  gettimeofday(&t1, 0);
+  gemm(transA, transB, m, n, p, alpha, A, lda, B, ldb, beta, C, ldc);
+  gettimeofday(&t2, 0);
+  unsigned long long runtime_us = todval(&t2) - todval(&t1);
+  printf("%f\n", runtime_us / 1000000.0);
+
+  double gflops = 2.0 * m * n * p / runtime_us / 1000.0;
+  double peak = peak_flops<T>() * __cilkrts_get_nworkers() / 1e9;
+  fprintf(stderr, "GFLOP/s = %.2f, %.0f%% of the measured peak of %.2f "
+                  "(%d workers, %s kernel)\n",
+          gflops, 100.0 * gflops / peak, peak, __cilkrts_get_nworkers(),
+          KERNEL_ISA);
+
+  operand<T> opA = {A, lda, (bool)transA}, opB = {B, ldb, (bool)transB};
+  if (rand_check) {
+    /* C * R = alpha * op(A) * (op(B) * R) + beta * C0 * R */
+    T *R = (T *)malloc(p * sizeof(T));
+    T *P1 = (T *)malloc(n * sizeof(T));
+    T *P2 = (T *)malloc(m * sizeof(T));
+    T *P3 = (T *)malloc(m * sizeof(T));
+    init_vec(R, p); // randomly select real values from [0-99]
+    gemv<T>(transB, n, p, 1, B, ldb, R, 0, P1);
+    gemv<T>(transA, m, n, alpha, A, lda, P1, 0, P2);
+    if (beta != (T)0)
+      gemv<T>(false, m, p, beta, C0, ldc, R, 1, P2);
+    gemv<T>(false, m, p, 1, C, ldc, R, 0, P3);
+    err = maxerror_vec(P3, P2, m);
+
+    fprintf(stderr, "Max error     = %g\n", err);
+    free(R);
+    free(P1);
+    free(P2);
+    free(P3);
+
+  } else if (check) {
+    iter_matmul(opA, opB, C0, ldc, m, n, p, alpha, beta);
+    err = maxerror(C, C0, m, p);
+
+    fprintf(stderr, "Max error     = %g\n", err);
+  }
+
+  free(C);
+  free(B);
+  free(A);
+  free(C0);
+
+  return 0;
+}
+
+/*
+ * Time y = op(A) * x for a random m x n op(A), report the bandwidth it
+ * achieves, and optionally check it against the naive loop.
+ */
+template <typename T> int run_gemv(int m, int n, int transA, int check) {
+
+  int lda = transA ? m : n;
+  T *A = (T *)malloc((long)m * n * sizeof(T));
+  T *x = (T *)malloc(n * sizeof(T));
+  T *y = (T *)malloc(m * sizeof(T));
+  const int reps = 10;
+
+  init(A, transA ? n : m, lda);
+  init_vec(x, n);
+  gemv<T>(transA, m, n, 1, A, lda, x, 0, y); /* warm up */
+
+  struct timeval t1, t2;
+  gettimeofday(&t1, 0);
+  for (int r = 0; r < reps; r++)
+    gemv<T>(transA, m, n, 1, A, lda, x, 0, y);
+  gettimeofday(&t2, 0);
+  double secs = (todval(&t2) - todval(&t1)) / 1000000.0 / reps;
+  printf("%f\n", secs);
+
+  double bytes = ((double)m * n + m + n) * sizeof(T);
+  fprintf(stderr, "GEMV: %.2f GB/s, %.2f GFLOP/s (%s kernel)\n",
+          bytes / secs / 1e9, 2.0 * m * n / secs / 1e9, KERNEL_ISA);
+
+  if (check) {
+    T *y2 = (T *)malloc(m * sizeof(T));
+    operand<T> opA = {A, lda, (bool)transA};
+    for (int i = 0; i < m; i++) {
+      y2[i] = 0;
+      for (int j = 0; j < n; j++)
+        y2[i] += opA(i, j) * x[j];
+    }
+    fprintf(stderr, "Max error     = %g\n", maxerror_vec(y2, y, m));
+    free(y2);
+  }
+
+  free(A);
+  free(x);
+  free(y);
+
+  return 0;
+}
+
+/*
+ * Multiply batch random m x n matrices by random n x p matrices with
+ * gemm_batched, time it against one gemm call per product, and optionally
+ * check every product against iter_matmul.
+ */
+template <typename T>
+int run_batched(int batch, int m, int n, int p, T alpha, T beta, int check) {
+
+  long sa = (long)m * n, sb = (long)n * p, sc = (long)m * p;
+  T *A = (T *)malloc(batch * sa * sizeof(T));
+  T *B = (T *)malloc(batch * sb * sizeof(T));
+  T *C = (T *)malloc(batch * sc * sizeof(T));
+  T *C1 = (T *)malloc(batch * sc * sizeof(T));
+
+  init(A, batch * m, n);
+  init(B, batch * n, p);
+  init(C, batch * m, p);
+  memcpy(C1, C, batch * sc * sizeof(T));
+  T *C0 = NULL;
+  if (check) {
+    C0 = (T *)malloc(batch * sc * sizeof(T));
+    memcpy(C0, C, batch * sc * sizeof(T));
+  }
+
+  struct timeval t1, t2;
+  gettimeofday(&t1, 0);
+  for (int b = 0; b < batch; b++)
+    gemm(false, false, m, n, p, alpha, A + b * sa, n, B + b * sb, p, beta,
+         C1 + b * sc, p);
+  gettimeofday(&t2, 0);
+  double secs1 = (todval(&t2) - todval(&t1)) / 1000000.0;
+
+  gettimeofday(&t1, 0);
+  gemm_batched(batch, m, n, p, alpha, A, B, beta, C);
+  gettimeofday(&t2, 0);
+  double secs = (todval(&t2) - todval(&t1)) / 1000000.0;
+  printf("%f\n", secs);
+
+  double flop = 2.0 * batch * m * n * p / 1e9;
+  fprintf(stderr, "batched: %.2f GFLOP/s, one gemm per product: %.2f "
+                  "GFLOP/s, speedup %.2fx\n",
+          flop / secs, flop / secs1, secs1 / secs);
+
+  if (check) {
+    double err = 0.0;
+    for (int b = 0; b < batch; b++) {
+      operand<T> opA = {A + b * sa, n, false}, opB = {B + b * sb, p, false};
+      iter_matmul(opA, opB, C0 + b * sc, p, m, n, p, alpha, beta);
+      err = fmax(err, maxerror(C + b * sc, C0 + b * sc, m, p));
+    }
+    fprintf(stderr, "Max error     = %g\n", err);
+  }
+
+  free(A);
+  free(B);
+  free(C);
+  free(C1);
+  free(C0);
+
+  return 0;
+}
+
+/*
+ * Time C = alpha * A * B for n x n A and B in the Morton layout, and the
+ * conversions to and from it, against gemm on the row-major matrices.
+ */
+template <typename T> int run_morton(int n, T alpha, int check) {
+
+  int s = morton_tiles(n), t = morton_tile(n);
+  long nn = (long)n * n, zz = (long)s * t * s * t;
+  T *A = (T *)malloc(nn * sizeof(T));
+  T *B = (T *)malloc(nn * sizeof(T));
+  T *C = (T *)malloc(nn * sizeof(T));
+  T *C1 = (T *)malloc(nn * sizeof(T));
+  T *Az = (T *)malloc(zz * sizeof(T));
+  T *Bz = (T *)malloc(zz * sizeof(T));
+  T *Cz = (T *)malloc(zz * sizeof(T));
+
+  init(A, n, n);
+  init(B, n, n);
+
+  struct timeval t1, t2;
+  gettimeofday(&t1, 0);
+  gemm(false, false, n, n, n, alpha, A, n, B, n, (T)0, C1, n);
+  gettimeofday(&t2, 0);
+  double secs1 = (todval(&t2) - todval(&t1)) / 1000000.0;
+
+  gettimeofday(&t1, 0);
+  cilk_scope {
+    cilk_spawn to_morton(A, n, n, Az);
+    to_morton(B, n, n, Bz);
+  }
+  gettimeofday(&t2, 0);
+  double secs_in = (todval(&t2) - todval(&t1)) / 1000000.0;
+
+  gettimeofday(&t1, 0);
+  rec_matmul_z(Az, Bz, Cz, s, t, alpha, 0);
+  gettimeofday(&t2, 0);
+  double secs = (todval(&t2) - todval(&t1)) / 1000000.0;
+  printf("%f\n", secs);
+
+  gettimeofday(&t1, 0);
+  from_morton(Cz, n, C, n);
+  gettimeofday(&t2, 0);
+  double secs_out = (todval(&t2) - todval(&t1)) / 1000000.0;
+
+  double flop = 2.0 * n * n * n / 1e9;
+  fprintf(stderr, "morton: %.2f GFLOP/s on %d x %d tiles of %d, row-major: "
+                  "%.2f GFLOP/s, speedup %.2fx\n",
+          flop / secs, s, s, t, flop / secs1, secs1 / secs);
+  fprintf(stderr, "conversion: %f s to the Morton layout, %f s back\n",
+          secs_in, secs_out);
+
+  if (check) {
+    operand<T> opA = {A, n, false}, opB = {B, n, false};
+    iter_matmul(opA, opB, C1, n, n, n, n, alpha, (T)0);
+    fprintf(stderr, "Max error     = %g\n", maxerror(C, C1, n, n));
+  }
+
+  free(A);
+  free(B);
+  free(C);
+  free(C1);
+  free(Az);
+  free(Bz);
+  free(Cz);
+
+  return 0;
+}
+
+/* seconds taken by C = A * B for row-major m x n A and n x p B */
+template <typename In, typename T>
+double time_gemm(int m, int n, int p, const In *A, const In *B, T *C) {
+
+  struct timeval t1, t2;
+  gettimeofday(&t1, 0);
+  gemm(false, false, m, n, p, (T)1, A, n, B, p, (T)0, C, p);
+  gettimeofday(&t2, 0);
+  return (todval(&t2) - todval(&t1)) / 1000000.0;
+}
+
+/* the len elements of X converted by f, in parallel */
+template <typename In, typename F>
+In *convert(const float *X, long len, F f) {
+
+  In *Y = (In *)malloc(len * sizeof(In));
+  cilk_for (long i = 0; i < len; i++)
+    Y[i] = f(X[i]);
+  return Y;
+}
+
+float max_abs(const float *X, long len) {
+
+  float max = 0;
+  for (long i = 0; i < len; i++)
+    if (fabsf(X[i]) > max)
+      max = fabsf(X[i]);
+  return max;
+}
+
+/*
+ * Multiply a random m x n A by a random n x p B in fp32 and again in the
+ * reduced precision prec: with the inputs rounded to bf16 or fp16, or
+ * quantized to int8_t with one scale per matrix.  Time both and, with
+ * check, report the errors of both against iter_matmul in fp32.
+ */
+int run_lowp(int m, int n, int p, const char *prec, int check) {
+
+  long mn = (long)m * n, np = (long)n * p, mp = (long)m * p;
+  float *A = (float *)malloc(mn * sizeof(float));
+  float *B = (float *)malloc(np * sizeof(float));
+  float *C32 = (float *)malloc(mp * sizeof(float));
+  float *C = (float *)malloc(mp * sizeof(float));
+  const char *kernel = KERNEL_ISA;
+  double secs, secs32;
+
+  /* scale the random inputs into [0, 1], within the range of fp16 */
+  init(A, m, n);
+  init(B, n, p);
+  float sa = max_abs(A, mn), sb = max_abs(B, np);
+  cilk_for (long i = 0; i < mn; i++)
+    A[i] /= sa;
+  cilk_for (long i = 0; i < np; i++)
+    B[i] /= sb;
+  secs32 = time_gemm(m, n, p, A, B, C32);
+
+  if (!strcmp(prec, "bf16")) {
+    bf16 *Al = convert<bf16>(A, mn, to_bf16);
+    bf16 *Bl = convert<bf16>(B, np, to_bf16);
+    secs = time_gemm(m, n, p, Al, Bl, C);
+#if defined(__AVX512BF16__)
+    kernel = "avx512_bf16";
+#endif
+    free(Al);
+    free(Bl);
+  } else if (!strcmp(prec, "fp16")) {
+    fp16 *Al = convert<fp16>(A, mn, to_fp16);
+    fp16 *Bl = convert<fp16>(B, np, to_fp16);
+    secs = time_gemm(m, n, p, Al, Bl, C);
+    free(Al);
+    free(Bl);
+  } else if (!strcmp(prec, "int8")) {
+    sa = max_abs(A, mn) / 127;
+    sb = max_abs(B, np) / 127;
+    int8_t *Al = convert<int8_t>(
+        A, mn, [=](float x) { return (int8_t)lrintf(x / sa); });
+    int8_t *Bl = convert<int8_t>(
+        B, np, [=](float x) { return (int8_t)lrintf(x / sb); });
+    int32_t *Ci = (int32_t *)malloc(mp * sizeof(int32_t));
+    secs = time_gemm(m, n, p, Al, Bl, Ci);
+    cilk_for (long i = 0; i < mp; i++)
+      C[i] = Ci[i] * sa * sb;
+#if defined(MATMUL_SIMD) && defined(__AVX512VNNI__)
+    kernel = "avx512_vnni";
+#elif defined(MATMUL_SIMD)
+    kernel = "portable";
+#endif
+    free(Al);
+    free(Bl);
+    free(Ci);
+  } else {
+    fprintf(stderr, "unknown precision %s: use fp32, bf16, fp16 or int8\n",
+            prec);
+    exit(1);
+  }
+  printf("%f\n", secs);
+
+  double flop = 2.0 * m * n * p / 1e9;
+  fprintf(stderr, "fp32: %.2f GFLOP/s, %s: %.2f GFLOP/s (%s kernel), "
+                  "speedup %.2fx\n",
+          flop / secs32, prec, flop / secs, kernel, secs32 / secs);
+
+  if (check) {
+    float *Cref = (float *)malloc(mp * sizeof(float));
+    operand<float> opA = {A, n, false}, opB = {B, p, false};
+    iter_matmul(opA, opB, Cref, p, m, n, p, 1.0f, 0.0f);
+    fprintf(stderr, "fp32 error: max %g, mean %g\n",
+            maxerror_vec(Cref, C32, mp), sum_diff_vec(Cref, C32, mp) / mp);
+    fprintf(stderr, "%s error: max %g, mean %g\n", prec,
+            maxerror_vec(Cref, C, mp), sum_diff_vec(Cref, C, mp) / mp);
+    free(Cref);
+  }
+
+  free(A);
+  free(B);
+  free(C32);
+  free(C);
+
+  return 0;
+}
+
+const char *specifiers[] = {"-n",  "-c",     "-rc",   "-h",      "-m",
+                            "-p",  "-ta",    "-tb",   "-alpha",  "-beta",
+                            "-double", "-serialk", "-gemv", "-prec",
+                            "-batch", "-morton", 0};
+int opt_types[] = {INTARG,  BOOLARG,   BOOLARG,   BOOLARG,
+                   INTARG,  INTARG,    BOOLARG,   BOOLARG,
+                   DOUBLEARG, DOUBLEARG, BOOLARG, BOOLARG,
+                   BOOLARG, STRINGARG, INTARG, BOOLARG, 0};
+
+int main(int argc, char *argv[]) {
+
+  int n = 1024;                            // default input size
+  int m = 0, p = 0;                        // default to n
+  int check = 0, rand_check = 0, help = 0; // default options
+  int transA = 0, transB = 0, dbl = 0, serialk = 0, gemv_mode = 0;
+  int batch = 0, morton = 0;
+  double alpha = 1.0, beta = 0.0;
+  char prec[64] = "fp32";
+
+  get_options(argc, argv, specifiers, opt_types, &n, &check, &rand_check,
+              &help, &m, &p, &transA, &transB, &alpha, &beta, &dbl, &serialk,
+              &gemv_mode, prec, &batch, &morton);
+
+  if (help) {
+    fprintf(stderr,
+            "Usage: matmul [-n size] [-m rows] [-p cols] [-ta] [-tb] "
+            "[-alpha a] [-beta b]\n"
+            "              [-double] [-serialk] [-gemv] [-prec p] "
+            "[-batch count] [-morton]\n"
+            "              [-c] [-rc] [-h] [<cilk options>]\n");
+    fprintf(stderr, "computes C = alpha * op(A) * op(B) + beta * C for "
+                    "m x n op(A) and n x p op(B),\n"
+                    "where -ta and -tb transpose A and B; m and p "
+                    "default to n.\n");
+    fprintf(stderr, "if -double is set, use double instead of single "
+                    "precision.\n");
+    fprintf(stderr, "if -serialk is set, split the inner dimension n "
+                    "serially; compare on small\n"
+                    "outputs with a large n, e.g. -m 64 -p 64 -n 1000000.\n");
+    fprintf(stderr, "if -gemv is set, instead time the matrix-vector "
+                    "multiply y = op(A) * x\n"
+                    "for m x n op(A) and report its bandwidth.\n");
+    fprintf(stderr, "if -prec is bf16, fp16 or int8, instead time C = A * B "
+                    "with its inputs in that\n"
+                    "precision, accumulated in fp32 or int32, against "
+                    "fp32; -c reports the error\n"
+                    "of both.\n");
+    fprintf(stderr, "if -batch is set, instead multiply count pairs of "
+                    "small matrices with\n"
+                    "gemm_batched, e.g. -batch 10000 -n 32, and compare "
+                    "with one gemm per pair.\n");
+    fprintf(stderr, "if -morton is set, instead time C = alpha * A * B for "
+                    "n x n A and B stored\n"
+                    "as tiles in Z order, and compare with the row-major "
+                    "multiply.\n");
+    fprintf(stderr, "if -c is set, "
+                    "check result against iterative matrix multiply O(n^3).\n");
+    fprintf(stderr,
+            "if -rc is set, check "
+            "result against randomlized algo. due to Freivalds O(n^2).\n");
+    exit(1);
+  }
+  if (m <= 0)
+    m = n;
+  if (p <= 0)
+    p = n;
+
+  parallel_ksplit = !serialk;
+  if (strcmp(prec, "fp32"))
+    run_lowp(m, n, p, prec, check);
+  else if (morton && dbl)
+    run_morton<double>(n, alpha, check);
+  else if (morton)
+    run_morton<float>(n, (float)alpha, check);
+  else if (batch > 0 && dbl)
+    run_batched<double>(batch, m, n, p, alpha, beta, check);
+  else if (batch > 0)
+    run_batched<float>(batch, m, n, p, alpha, beta, check);
+  else if (gemv_mode && dbl)
+    run_gemv<double>(m, n, transA, check);
+  else if (gemv_mode)
+    run_gemv<float>(m, n, transA, check);
+  else if (dbl)
+    run<double>(m, n, p, transA, transB, alpha, beta, check, rand_check);
+  else
+    run<float>(m, n, p, transA, transB, alpha, beta, check, rand_check);
+
+  fprintf(stderr, "\nCilk Example: matmul\n");
+  fprintf(stderr, "Options: m = %d, n = %d, p = %d, %s%s%s, alpha = %g, "
+                  "beta = %g%s\n",
+          m, n, p, strcmp(prec, "fp32") ? prec : dbl ? "double" : "float",
+          transA ? ", op(A) = A^T" : "", transB ? ", op(B) = B^T" : "", alpha,
+          beta,
+          serialk ? ", serial inner splits" : "");
+
+  return 0;
+}
@@ -26,17 +26,275 @@
  */
 
 #include <cilk/cilk.h>
+#include <cilk/opadd_reducer.h>
 #include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <iterator>
 #include <functional>
-#include <random>
+#include <string>
+#include <vector>
 #include <sys/time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #ifdef SERIAL
 #include <cilk/cilk_stub.h>
 #endif
 
+#define INPUT_ELM int
+#include "randinput.h"
+
+// Partition [begin, end) so that the elements satisfying pred come first,
+// and return the first element that does not, without branching on the
+// outcome of pred (Edelkamp and Weiss, BlockQuicksort, ESA 2016).
+//
+// A block of BLOCK elements at the left end records, into an offset
+// buffer, the positions of elements that fail pred, and a block at the
+// right end records those that satisfy it; the recorded elements are then
+// swapped pairwise.  Only the loop structure branches, never on the data.
+// The final few blocks are handed to std::partition.
+const int BLOCK = 64;
+
+template <typename Pred>
+int * block_partition(int * begin, int * end, Pred pred) {
+  unsigned char offl[BLOCK], offr[BLOCK];
+  int numl = 0, numr = 0, startl = 0, startr = 0;
+  int * first = begin;
+  int * last = end;
+
+  while (last - first > 2 * BLOCK) {
+    if (numl == 0) {
+      startl = 0;
+      for (int i = 0; i < BLOCK; ++i) {
+        offl[numl] = i;
+        numl += !pred(first[i]);
+      }
+    }
+    if (numr == 0) {
+      startr = 0;
+      for (int i = 0; i < BLOCK; ++i) {
+        offr[numr] = i;
+        numr += pred(*(last - 1 - i));
+      }
+    }
+    int num = std::min(numl, numr);
+    for (int k = 0; k < num; ++k)
+      std::swap(first[offl[startl + k]], *(last - 1 - offr[startr + k]));
+    numl -= num;
+    numr -= num;
+    startl += num;
+    startr += num;
+    if (numl == 0)
+      first += BLOCK;
+    if (numr == 0)
+      last -= BLOCK;
+  }
+
+  // Everything before first satisfies pred and everything from last on
+  // fails it; pending offsets only describe elements of [first, last).
+  return std::partition(first, last, pred);
+}
+
+// Set by the harness to compare against the branchy std::partition.
+bool use_block_partition = true;
+
+template <typename Pred>
+int * partition_kernel(int * begin, int * end, Pred pred) {
+  if (use_block_partition)
+    return block_partition(begin, end, pred);
+  return std::partition(begin, end, pred);
+}
+
+// Ranges at most this long are sorted by a sorting network.
+const int NETWORK_SIZE = 16;
+
+// Sort the n <= NETWORK_SIZE elements of a with Batcher's odd-even merge
+// sort network, padding with INT_MAX.  Every compare-exchange is a min and
+// a max, so there are no data-dependent branches.
+void network_sort(int * a, int n) {
+  int v[NETWORK_SIZE];
+  std::memcpy(v, a, n * sizeof(int));
+  std::fill(v + n, v + NETWORK_SIZE, INT_MAX);
+  for (int p = 1; p < NETWORK_SIZE; p += p)
+    for (int k = p; k > 0; k /= 2)
+      for (int j = k % p; j + k < NETWORK_SIZE; j += k + k)
+        for (int i = 0; i < k && i + j + k < NETWORK_SIZE; ++i)
+          if ((i + j) / (p + p) == (i + j + k) / (p + p)) {
+            int x = v[i + j], y = v[i + j + k];
+            v[i + j] = std::min(x, y);
+            v[i + j + k] = std::max(x, y);
+          }
+  std::memcpy(a, v, n * sizeof(int));
+}
+
+// Ranges at least this long are partitioned in parallel.
+const long PARALLEL_PARTITION_CUTOFF = 1 << 16;
+const long PARTITION_BLOCK = 1 << 14;
+
+// Partition [begin, end) in parallel so that the elements satisfying pred
+// come first, and return the first element that does not, like
+// std::partition.
+//
+// Each block of PARTITION_BLOCK elements is first partitioned on its own,
+// in parallel.  If L elements satisfy pred, the blocks then hold as many
+// elements failing pred in [begin, begin + L) as elements satisfying it
+// in [begin + L, end).  Prefix sums over the blocks number both kinds of
+// misplaced elements, and the t-th of each kind are swapped with each
+// other, again in parallel.
+template <typename Pred>
+int * parallel_partition(int * begin, int * end, Pred pred) {
+  long n = end - begin;
+  long nblocks = (n + PARTITION_BLOCK - 1) / PARTITION_BLOCK;
+  std::vector<long> lt(nblocks), mg(nblocks + 1), ml(nblocks + 1);
+
+  cilk_for (long k = 0; k < nblocks; ++k) {
+    int * b = begin + k * PARTITION_BLOCK;
+    int * e = std::min(b + PARTITION_BLOCK, end);
+    lt[k] = partition_kernel(b, e, pred) - b;
+  }
+
+  long L = 0;
+  for (long k = 0; k < nblocks; ++k)
+    L += lt[k];
+
+  // Misplaced elements of block k: those failing pred start at gstart(k),
+  // and those satisfying it start at lstart(k).
+  auto gstart = [&](long k) { return k * PARTITION_BLOCK + lt[k]; };
+  auto lstart = [&](long k) { return std::max(k * PARTITION_BLOCK, L); };
+  for (long k = 0; k < nblocks; ++k) {
+    long e = std::min((k + 1) * PARTITION_BLOCK, n);
+    mg[k + 1] = mg[k] + std::max(0L, std::min(e, L) - gstart(k));
+    ml[k + 1] = ml[k] + std::max(0L, gstart(k) - lstart(k));
+  }
+
+  long m = mg[nblocks];
+  long chunk = (m + nblocks - 1) / nblocks;
+  if (chunk == 0)
+    return begin + L;
+  cilk_for (long t0 = 0; t0 < m; t0 += chunk) {
+    long t1 = std::min(t0 + chunk, m);
+    long kg = std::upper_bound(mg.begin(), mg.end(), t0) - mg.begin() - 1;
+    long kl = std::upper_bound(ml.begin(), ml.end(), t0) - ml.begin() - 1;
+    long og = t0 - mg[kg], ol = t0 - ml[kl];
+    for (long t = t0; t < t1; ++t, ++og, ++ol) {
+      while (og == mg[kg + 1] - mg[kg]) {
+        ++kg;
+        og = 0;
+      }
+      while (ol == ml[kl + 1] - ml[kl]) {
+        ++kl;
+        ol = 0;
+      }
+      std::swap(begin[gstart(kg) + og], begin[lstart(kl) + ol]);
+    }
+  }
+
+  return begin + L;
+}
+
+template <typename Pred>
+int * partition_range(int * begin, int * end, Pred pred) {
+  if (end - begin >= PARALLEL_PARTITION_CUTOFF)
+    return parallel_partition(begin, end, pred);
+  return partition_kernel(begin, end, pred);
+}
+
+// Return the median of *a, *b and *c.
+int * med3(int * a, int * b, int * c) {
+  if (*a < *b) {
+    if (*b < *c)
+      return b;
+    return (*a < *c) ? c : a;
+  }
+  if (*a < *c)
+    return a;
+  return (*b < *c) ? c : b;
+}
+
+// Choose the pivot of [begin, end): the median of the first, middle and
+// last elements for short ranges, and Tukey's ninther, the median of three
+// such medians of three spread over the range, for longer ones.  Sorted
+// and reverse-sorted ranges then split evenly.
+int * choose_pivot(int * begin, int * end) {
+  long n = end - begin;
+  int * mid = begin + n / 2;
+  if (n < 128)
+    return med3(begin, mid, end - 1);
+  long s = n / 8;
+  return med3(med3(begin, begin + s, begin + 2 * s),
+              med3(mid - s, mid, mid + s),
+              med3(end - 1 - 2 * s, end - 1 - s, end - 1));
+}
+
+// Ranges shorter than serial_cutoff are sorted without spawning, so the
+// bottom of the recursion does not pay for millions of tiny tasks.
+long serial_cutoff = 4096;
+
+// Number of spawns made by sample_qsort, for the harness to report.
+cilk::opadd_reducer<long> spawn_count = 0;
+
+// Recursive step of sample_qsort.  depth bounds the remaining recursion;
+// when it runs out, the range is heapsorted instead, so adversarial inputs
+// cost O(n log n) work.  pred, if not null, points to an element that is
+// <= every element of the range (the pivot that split it off).  The serial
+// instance (Spawn = false) runs the same algorithm without spawning.
+template <bool Spawn>
+void qsort_rec(int * begin, int * end, int depth, const int * pred) {
+  if (Spawn && end - begin < serial_cutoff) {
+    qsort_rec<false>(begin, end, depth, pred);
+    return;
+  }
+  if (end - begin <= NETWORK_SIZE) {
+    network_sort(begin, end - begin);
+    return;
+  }
+  if (depth == 0) {
+    std::make_heap(begin, end);
+    std::sort_heap(begin, end);
+    return;
+  }
+
+  using std::swap;
+  swap(*choose_pivot(begin, end), *(end - 1));
+  --end;  // Exclude last element (pivot) from partition
+  int pivot = *end;
+
+  if (pred && !(*pred < pivot)) {
+    // The pivot equals *pred and so is the least element of the range.
+    // Gather all the elements equal to it on the left, where they are
+    // done, and sort the rest.  This makes runs of duplicates cost linear
+    // work instead of degrading quicksort.
+    int * middle = partition_range(begin, end,
+                                   [pivot](int em) { return !(pivot < em); });
+    swap(*end, *middle);
+    qsort_rec<Spawn>(middle + 1, end + 1, depth - 1, middle);
+    return;
+  }
+
+  int * middle = partition_range(begin, end,
+                                 [pivot](int em) { return em < pivot; });
+  swap(*end, *middle);    // move pivot to middle
+
+  if (!Spawn) {
+    qsort_rec<false>(begin, middle, depth - 1, pred);
+    qsort_rec<false>(middle + 1, end + 1, depth - 1, middle);
+    return;
+  }
+
+  spawn_count += 1;
+  cilk_scope {
+    cilk_spawn qsort_rec<true>(begin, middle, depth - 1, pred);
+    qsort_rec<true>(middle + 1, end + 1, depth - 1, middle); // Exclude pivot and restore end
+  }
+}
+
 // Sort the range between bidirectional iterators begin and end.
 // end is one past the final element in the range.
 // Use the Quick Sort algorithm, using recursive divide and conquer.
@@ -44,56 +302,435 @@
 // This implementation is pure C++ code before Intel(R) Cilk(TM) Plus 
 // conversion.
 void sample_qsort(int * begin, int * end) {
-  if (begin != end) {
-    --end;  // Exclude last element (pivot) from partition
-    int pivot = *end;
-    int * middle = std::partition(begin, end, [pivot](int em) { return em < pivot; });
-    using std::swap;
-    swap(*end, *middle);    // move pivot to middle
-
-    cilk_scope {
-      cilk_spawn sample_qsort(begin, middle);
-      sample_qsort(++middle, ++end); // Exclude pivot and restore end
+  int depth = 0;
+  for (long n = end - begin; n > 1; n >>= 1)
+    depth += 2;
+  qsort_rec<true>(begin, end, depth, nullptr);
+}
+
+// The number of adjacent pairs of a that are out of order.
+long count_descents(const int * a, int n) {
+  cilk::opadd_reducer<long> descents = 0;
+  cilk_for (int i = 0; i < n - 1; ++i)
+    descents += a[i] > a[i + 1];
+  return descents;
+}
+
+// adaptive_qsort merges inputs made of few runs.  Each task scans
+// RUN_BLOCK elements for runs, runs shorter than MIN_RUN are extended and
+// sorted, as in TimSort, and merges of fewer than MERGE_CUTOFF elements
+// are done serially.
+const long RUN_BLOCK = 256 * 1024;
+const long MIN_RUN = 2048;
+const long MERGE_CUTOFF = 8192;
+
+// Merge the sorted ranges [a, a_end) and [b, b_end) into out.  The longer
+// range is split at its middle and the other at the same value, and the
+// two halves are merged in parallel.
+void parallel_merge(const int * a, const int * a_end,
+                    const int * b, const int * b_end, int * out) {
+  if (a_end - a < b_end - b) {
+    std::swap(a, b);
+    std::swap(a_end, b_end);
+  }
+  if ((a_end - a) + (b_end - b) <= MERGE_CUTOFF) {
+    std::merge(a, a_end, b, b_end, out);
+    return;
+  }
+  const int * a_mid = a + (a_end - a) / 2;
+  const int * b_mid = std::lower_bound(b, b_end, *a_mid);
+  cilk_scope {
+    cilk_spawn parallel_merge(a, a_mid, b, b_mid, out);
+    parallel_merge(a_mid, a_end, b_mid, b_end,
+                   out + (a_mid - a) + (b_mid - b));
+  }
+}
+
+// Split base[lo, hi) into sorted runs of at least MIN_RUN elements (except
+// at the end) and append their starts to starts.  Strictly descending runs
+// are reversed in place, and short runs are extended and sorted.
+void find_runs(int * base, long lo, long hi, std::vector<long> &starts) {
+  for (long i = lo; i < hi;) {
+    long j = i + 1;
+    if (j < hi && base[j] < base[i]) {
+      while (j < hi && base[j] < base[j - 1])
+        ++j;
+      std::reverse(base + i, base + j);
+    } else {
+      while (j < hi && !(base[j] < base[j - 1]))
+        ++j;
     }
+    if (j - i < MIN_RUN) {
+      j = std::min(hi, i + MIN_RUN);
+      sample_qsort(base + i, base + j);
+    }
+    starts.push_back(i);
+    i = j;
+  }
+}
+
+// Merge runs lo..hi-1 of a, where run r is [bounds[r], bounds[r + 1]), by
+// a balanced tree of parallel merges.  The result goes to b if to_b is set
+// and to a otherwise; halves that are already in order are just copied.
+void merge_runs(int * a, int * b, const long * bounds, long lo, long hi,
+                bool to_b) {
+  if (hi - lo == 1) {
+    if (to_b)
+      std::copy(a + bounds[lo], a + bounds[hi], b + bounds[lo]);
+    return;
+  }
+  long mid = (lo + hi) / 2;
+  cilk_scope {
+    cilk_spawn merge_runs(a, b, bounds, lo, mid, !to_b);
+    merge_runs(a, b, bounds, mid, hi, !to_b);
+  }
+  const int * src = to_b ? a : b;
+  int * dst = to_b ? b : a;
+  if (!(src[bounds[mid]] < src[bounds[mid] - 1]))
+    std::copy(src + bounds[lo], src + bounds[hi], dst + bounds[lo]);
+  else
+    parallel_merge(src + bounds[lo], src + bounds[mid], src + bounds[mid],
+                   src + bounds[hi], dst + bounds[lo]);
+}
+
+// Sort [begin, end) as a natural mergesort: find the runs of each block in
+// parallel, drop the run boundaries that are already in order, and merge
+// the remaining runs, so an input of r runs takes O(n log r) work.
+void natural_mergesort(int * begin, int * end) {
+  long n = end - begin;
+  long nblocks = (n + RUN_BLOCK - 1) / RUN_BLOCK;
+  std::vector<std::vector<long>> block_starts(nblocks);
+  cilk_for (long k = 0; k < nblocks; ++k)
+    find_runs(begin, k * RUN_BLOCK, std::min(n, (k + 1) * RUN_BLOCK),
+              block_starts[k]);
+
+  std::vector<long> bounds;
+  for (const std::vector<long> &starts : block_starts)
+    for (long s : starts)
+      if (s == 0 || begin[s] < begin[s - 1])
+        bounds.push_back(s);
+  bounds.push_back(n);
+
+  long nruns = bounds.size() - 1;
+  if (nruns > 1) {
+    int * tmp = new int[n];
+    merge_runs(begin, tmp, bounds.data(), 0, nruns, false);
+    delete[] tmp;
+  }
+}
+
+// Sort the range [begin, end), adapting to presorted input.  One parallel
+// pass counts the descents: sorted input is then done, strictly descending
+// input is reversed, and input with at most one descent per MIN_RUN
+// elements, whose runs are long enough to pay for merging, is sorted by
+// natural_mergesort.  Anything else goes to sample_qsort.
+void adaptive_qsort(int * begin, int * end) {
+  long n = end - begin;
+  if (n < 2)
+    return;
+  long descents = count_descents(begin, n);
+  if (descents == 0)
+    return;
+  if (descents == n - 1) {
+    cilk_for (long i = 0; i < n / 2; ++i)
+      std::swap(begin[i], begin[n - 1 - i]);
+    return;
+  }
+  if (descents <= n / MIN_RUN)
+    natural_mergesort(begin, end);
+  else
+    sample_qsort(begin, end);
+}
+
+// Rearrange [begin, end) so that *nth is the element a full sort would put
+// there, with no greater element before it and no smaller one after it.
+// This is quickselect on the qsort_rec partitioning: each step partitions
+// the range, in parallel when it is large, and continues only into the
+// side that holds nth, so the expected work is O(n) instead of O(n log n).
+// Equal keys are gathered as in qsort_rec, and once the depth bound runs
+// out the rest is left to the introselect of std::nth_element.
+void parallel_nth_element(int * begin, int * nth, int * end) {
+  if (nth < begin || nth >= end)
+    return;
+  int depth = 0;
+  for (long n = end - begin; n > 1; n >>= 1)
+    depth += 2;
+
+  using std::swap;
+  const int * pred = nullptr;
+  while (end - begin > NETWORK_SIZE) {
+    if (depth-- == 0) {
+      std::nth_element(begin, nth, end);
+      return;
+    }
+    swap(*choose_pivot(begin, end), *(end - 1));
+    int pivot = *(end - 1);
+    int * middle;
+    if (pred && !(*pred < pivot)) {
+      // [begin, middle] all equal the least element of the range.
+      middle = partition_range(begin, end - 1,
+                               [pivot](int em) { return !(pivot < em); });
+      swap(*(end - 1), *middle);
+      if (nth <= middle)
+        return;
+    } else {
+      middle = partition_range(begin, end - 1,
+                               [pivot](int em) { return em < pivot; });
+      swap(*(end - 1), *middle);
+      if (nth == middle)
+        return;
+      if (nth < middle) {
+        end = middle;
+        continue;
+      }
+    }
+    pred = middle;
+    begin = middle + 1;
   }
+  network_sort(begin, end - begin);
+}
+
+// Sort the middle - begin smallest elements of [begin, end) into
+// [begin, middle), leaving the rest in unspecified order after them.
+void parallel_partial_sort(int * begin, int * middle, int * end) {
+  if (middle <= begin)
+    return;
+  parallel_nth_element(begin, middle - 1, end);
+  sample_qsort(begin, middle - 1);
+}
+
+// Ranges at most max(TOP_K_LEAF, 4k) long are scanned serially by top_k.
+const long TOP_K_LEAF = 1 << 20;
+
+// Return the k smallest elements of [begin, end) in ascending order,
+// leaving the range untouched.  Each leaf keeps its k smallest elements in
+// a max-heap in one pass, and the sorted results of the two halves of a
+// range are merged and cut to k, so the work is O(n log k).  For small k
+// the heap is rarely updated and this beats parallel_partial_sort, which
+// also has to copy the input; for large k the heap updates dominate.
+std::vector<int> top_k(const int * begin, const int * end, long k) {
+  long n = end - begin;
+  if (n <= std::max(TOP_K_LEAF, 4 * k)) {
+    std::vector<int> heap(begin, begin + std::min(n, k));
+    if (heap.empty())
+      return heap;
+    std::make_heap(heap.begin(), heap.end());
+    int bound = heap.front();
+    for (const int * p = begin + heap.size(); p < end; ++p)
+      if (*p < bound) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = *p;
+        std::push_heap(heap.begin(), heap.end());
+        bound = heap.front();
+      }
+    std::sort_heap(heap.begin(), heap.end());
+    return heap;
+  }
+
+  std::vector<int> left, right;
+  cilk_scope {
+    left = cilk_spawn top_k(begin, begin + n / 2, k);
+    right = top_k(begin + n / 2, end, k);
+  }
+  std::vector<int> out(std::min<long>(k, left.size() + right.size()));
+  auto l = left.begin(), r = right.begin();
+  for (int & x : out)
+    x = (r == right.end() || (l != left.end() && !(*r < *l))) ? *l++ : *r++;
+  return out;
 }
 
 unsigned long long todval (struct timeval *tp) {
     return tp->tv_sec * 1000 * 1000 + tp->tv_usec;
 }
 
+// Open a counter of the branch misses of the calling thread, or return -1
+// if it is unavailable.  The Cilk workers are not included, so run with
+// CILK_NWORKERS=1 to count the whole sort.
+int open_branch_miss_counter() {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+// An order-independent fingerprint of the multiset of values in a.
+unsigned long long fingerprint(const int * a, int n) {
+  cilk::opadd_reducer<unsigned long long> h = 0;
+  cilk_for (int i = 0; i < n; ++i) {
+    unsigned long long x = (unsigned)a[i] * 0x9e3779b97f4a7c15ULL;
+    h += (x ^ (x >> 29)) * 0xbf58476d1ce4e5b9ULL;
+  }
+  return h;
+}
+
+const char * const orders[] = {"random", "sorted", "reverse", "organ",
+                               "few-unique", "zipf", "runs", "nearly",
+                               "nearly-sorted"};
+
+bool valid_order(const std::string &order) {
+  return std::find(std::begin(orders), std::end(orders), order) !=
+         std::end(orders);
+}
+
+// Fill a with n integers in the given order:
+//   random     - a random permutation of 0..n-1
+//   sorted     - 0..n-1
+//   reverse    - n-1..0
+//   organ      - ascending then descending (an organ pipe)
+//   few-unique - random values in 0..15
+//   zipf       - Zipf-distributed (s = 1) values in 0..2^20-1
+//   runs       - 0..n-1 dealt into 64 interleaved ascending runs
+//   nearly     - 0..n-1 with 1% of the keys swapped in pairs (also
+//                accepted as nearly-sorted)
+// The random orders depend only on seed.
+void fill(int * a, int n, const std::string &order, uint64_t seed) {
+  if (order == "random") {
+    random_permutation(a, n, seed);
+  } else if (order == "few-unique") {
+    cilk_for (int i = 0; i < n; ++i)
+      a[i] = philox_word(seed, 0, i) & 15;
+  } else if (order == "zipf") {
+    // Invert the cumulative distribution.
+    std::vector<double> cdf(std::max(1, std::min(n, 1 << 20)));
+    double sum = 0;
+    for (size_t k = 0; k < cdf.size(); ++k)
+      cdf[k] = sum += 1.0 / (k + 1);
+    cilk_for (int i = 0; i < n; ++i) {
+      double u = philox_word(seed, 0, i) * 0x1p-32 * sum;
+      a[i] = std::min<long>(std::upper_bound(cdf.begin(), cdf.end(), u) -
+                                cdf.begin(),
+                            cdf.size() - 1);
+    }
+  } else if (order == "reverse") {
+    cilk_for (int i = 0; i < n; ++i)
+      a[i] = n - 1 - i;
+  } else if (order == "runs") {
+    runs_order(a, n, 64);
+  } else if (order == "nearly" || order == "nearly-sorted") {
+    nearly_order(a, n, seed);
+  } else if (order == "organ") {
+    cilk_for (int i = 0; i < n; ++i)
+      a[i] = i < n / 2 ? 2 * i : 2 * (n - 1 - i) + 1;
+  } else {
+    cilk_for (int i = 0; i < n; ++i)
+      a[i] = i;
+  }
+}
+
+// Time selecting the k smallest of the n elements of orig with
+// parallel_nth_element, parallel_partial_sort and top_k, and check the
+// results against sorted, the fully sorted input.
+int select_main(const int * orig, const int * sorted, int n, long k) {
+  std::vector<int> nth(orig, orig + n), partial(orig, orig + n);
+  struct timeval t1, t2;
+
+  gettimeofday(&t1, 0);
+  parallel_nth_element(nth.data(), nth.data() + k - 1, nth.data() + n);
+  gettimeofday(&t2, 0);
+  std::cerr << "nth_element: " << (todval(&t2) - todval(&t1)) / 1e6 << " s"
+            << std::endl;
+
+  gettimeofday(&t1, 0);
+  parallel_partial_sort(partial.data(), partial.data() + k,
+                        partial.data() + n);
+  gettimeofday(&t2, 0);
+  std::cerr << "partial_sort: " << (todval(&t2) - todval(&t1)) / 1e6 << " s"
+            << std::endl;
+
+  gettimeofday(&t1, 0);
+  std::vector<int> smallest = top_k(orig, orig + n, k);
+  gettimeofday(&t2, 0);
+  std::cerr << "top_k (heap merge): " << (todval(&t2) - todval(&t1)) / 1e6
+            << " s" << std::endl;
+
+  int kth = sorted[k - 1];
+  cilk::opadd_reducer<long> misplaced = 0;
+  cilk_for (int i = 0; i < n; ++i)
+    misplaced += i < k - 1 ? nth[i] > kth : nth[i] < kth;
+  if (nth[k - 1] != kth || misplaced != 0 ||
+      !std::equal(sorted, sorted + k, partial.begin()) ||
+      !std::equal(sorted, sorted + k, smallest.begin()) ||
+      (long)smallest.size() != k) {
+    std::cerr << "Selection of the " << k << " smallest failed" << std::endl;
+    return 1;
+  }
+  std::cerr << "Selection of the " << k << " smallest succeeded."
+            << std::endl;
+  return 0;
+}
+
 // A simple test harness 
-int qmain(int n) {
+int qmain(int n, const std::string &order, uint64_t seed, long k) {
 
   int* a = new int[n];
 
-  for (int i = 0; i < n; ++i)
-    a[i] = i;
-  std::random_device rd;
-  std::mt19937 g(rd());
-  std::shuffle(a, a + n, g);
+  fill(a, n, order, seed);
+  unsigned long long before = fingerprint(a, n);
+  std::vector<int> orig;
+  if (k > 0)
+    orig.assign(a, a + n);
 
-  std::cerr << "Sorting " << n << " integers" << std::endl;
+  std::cerr << "Sorting " << n << " integers (" << order << ", seed " << seed
+            << ")" << std::endl;
 
 
+  int counter = open_branch_miss_counter();
+#ifdef __linux__
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+
   struct timeval t1, t2;
   gettimeofday(&t1,0);
-sample_qsort(a, a + n);
+adaptive_qsort(a, a + n);
     gettimeofday(&t2,0);
     unsigned long long runtime_ms = (todval(&t2)-todval(&t1))/1000;
     std::cout << runtime_ms/1000.0 << "\n";
 
-  // Confirm that a is sorted and that each element contains the index.
-  for (int i = 0; i < n - 1; ++i) {
-    if (a[i] >= a[i + 1] || a[i] != i) {
-      std::cerr << "Sort failed at location i=" << i << " a[i] = "
-        << a[i] << " a[i+1] = " << a[i + 1] << std::endl;
-      delete[] a;
-      return 1;
-    }
+#ifdef __linux__
+  long long misses;
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter, &misses, sizeof(misses)) == sizeof(misses))
+      std::cerr << "Branch misses (" << (use_block_partition ? "block" : "std")
+                << " partition, calling thread): " << misses << std::endl;
+    close(counter);
+  }
+#endif
+
+  // Confirm that a is sorted and still holds the same values.
+  if (count_descents(a, n) != 0) {
+    int i = std::is_sorted_until(a, a + n) - a - 1;
+    std::cerr << "Sort failed at location i=" << i << " a[i] = "
+      << a[i] << " a[i+1] = " << a[i + 1] << std::endl;
+    delete[] a;
+    return 1;
+  }
+  if (fingerprint(a, n) != before) {
+    std::cerr << "Sort failed: the values changed" << std::endl;
+    delete[] a;
+    return 1;
   }
 
   std::cerr << "Sort succeeded." << std::endl;
+  std::cerr << "Spawns: " << (long)spawn_count << " (serial cutoff "
+            << serial_cutoff << ")" << std::endl;
+
+  if (k > 0 && select_main(orig.data(), a, n, k)) {
+    delete[] a;
+    return 1;
+  }
 
   delete[] a;
   return 0;
@@ -102,16 +739,51 @@ sample_qsort(a, a + n);
 int main(int argc, char* argv[]) {
 
   int n = 10 * 1000 * 1000;
+  std::string order = "random";
+  std::string kernel = "block";
+  uint64_t seed = 1;
+  long k = 0;
   if (argc > 1) {
     n = std::atoi(argv[1]);
-    if (n <= 0) {
+    if (argc > 2)
+      order = argv[2];
+    if (argc > 3)
+      kernel = argv[3];
+    if (argc > 4)
+      serial_cutoff = std::atol(argv[4]);
+    if (argc > 5)
+      seed = std::strtoull(argv[5], nullptr, 0);
+    if (argc > 6)
+      k = std::atol(argv[6]);
+    if (n <= 0 || !valid_order(order) ||
+        (kernel != "block" && kernel != "std") || serial_cutoff < 0 ||
+        k < 0 || k > n) {
       std::cerr << "Invalid argument" << std::endl;
-      std::cerr << "Usage: qsort N" << std::endl;
+      std::cerr << "Usage: qsort N [ORDER [KERNEL [CUTOFF [SEED [K]]]]]"
+                << std::endl;
       std::cerr << "       N = number of elements to sort" << std::endl;
+      std::cerr << "       ORDER = random (default), sorted, reverse, organ,"
+                << std::endl;
+      std::cerr << "               few-unique, zipf, runs or nearly "
+                << "(nearly-sorted)" << std::endl;
+      std::cerr << "       KERNEL = block (default, branch-free) or std "
+                << "(std::partition)" << std::endl;
+      std::cerr << "       CUTOFF = size below which ranges are sorted "
+                << "without spawning" << std::endl;
+      std::cerr << "                (default 4096)" << std::endl;
+      std::cerr << "       SEED = seed of the random orders (default 1), "
+                << "which give the" << std::endl;
+      std::cerr << "              same input for any number of workers"
+                << std::endl;
+      std::cerr << "       K = if positive, also time selecting the K "
+                << "smallest elements" << std::endl;
+      std::cerr << "           with nth_element, partial_sort and a heap "
+                << "merge top-k" << std::endl;
       return 1;
     }
   }
-  int ret = qmain(n);
+  use_block_partition = (kernel == "block");
+  int ret = qmain(n, order, seed, k);
 
   return ret;
 }
@@ -0,0 +1,176 @@
+/*
+ * Reproducible random inputs for the sorting benchmarks.
+ *
+ * philox is the counter-based Philox4x32-10 generator: the four random
+ * words for counter ctr of a stream are a pure function of the seed, so
+ * inputs can be generated in parallel and do not depend on the number of
+ * workers or the schedule.  Word i of a stream is word i % 4 of counter
+ * i / 4.
+ *
+ * A file that defines INPUT_ELM to its key type before including this
+ * header also gets generators of whole inputs of that type:
+ *
+ *   random_permutation  a random permutation of 0..n-1
+ *   runs_order          0..n-1 dealt into nruns ascending runs
+ *   nearly_order        0..n-1 with 1% of the keys swapped in pairs
+ *
+ * random_permutation sends key i to one of INPUT_BUCKETS buckets, chosen by
+ * word i of stream 0, lays the buckets out in order, counting blocks of
+ * INPUT_BLOCK keys in parallel, and then shuffles bucket b with stream
+ * b + 1.  Blocks and buckets have fixed sizes, so the permutation depends
+ * only on the seed.
+ */
+#ifndef RANDINPUT_H
+#define RANDINPUT_H
+
+#include <cilk/cilk.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+static inline void philox(uint64_t seed, uint64_t stream, uint64_t ctr,
+                          uint32_t out[4]) {
+
+  uint32_t c0 = ctr, c1 = ctr >> 32, c2 = stream, c3 = stream >> 32;
+  uint32_t k0 = seed, k1 = seed >> 32;
+
+  for (int r = 0; r < 10; ++r) {
+    uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+    uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+    c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+    c1 = (uint32_t)p1;
+    c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+    c3 = (uint32_t)p0;
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+/* word i of a stream */
+static inline uint32_t philox_word(uint64_t seed, uint64_t stream,
+                                   uint64_t i) {
+
+  uint32_t w[4];
+
+  philox(seed, stream, i / 4, w);
+  return w[i % 4];
+}
+
+/* map a random word to 0..n-1, for n <= 2^32 */
+static inline uint64_t rand_below(uint32_t r, uint64_t n) {
+
+  return (uint64_t)r * n >> 32;
+}
+
+#define INPUT_BUCKETS 1024
+#define INPUT_BLOCK (64 * 1024)
+
+#ifdef INPUT_ELM
+
+static inline void random_permutation(INPUT_ELM *a, long n, uint64_t seed) {
+
+  long nblocks = (n + INPUT_BLOCK - 1) / INPUT_BLOCK;
+
+  if (n == 0)
+    return;
+
+  /* count[b * nblocks + blk]: keys of block blk that go to bucket b */
+  long *count = (long *)calloc(INPUT_BUCKETS * nblocks, sizeof(long));
+  uint16_t *bucket = (uint16_t *)malloc(n * sizeof(uint16_t));
+
+  cilk_for (long blk = 0; blk < nblocks; ++blk) {
+    long lo = blk * INPUT_BLOCK;
+    long hi = n - lo < INPUT_BLOCK ? n : lo + INPUT_BLOCK;
+    uint32_t w[4];
+    for (long i = lo; i < hi; ++i) {
+      if (i % 4 == 0)
+        philox(seed, 0, i / 4, w);
+      bucket[i] = rand_below(w[i % 4], INPUT_BUCKETS);
+      count[bucket[i] * nblocks + blk]++;
+    }
+  }
+
+  long sum = 0;
+  for (long j = 0; j < INPUT_BUCKETS * nblocks; ++j) {
+    long c = count[j];
+    count[j] = sum;
+    sum += c;
+  }
+
+  cilk_for (long blk = 0; blk < nblocks; ++blk) {
+    long lo = blk * INPUT_BLOCK;
+    long hi = n - lo < INPUT_BLOCK ? n : lo + INPUT_BLOCK;
+    for (long i = lo; i < hi; ++i)
+      a[count[bucket[i] * nblocks + blk]++] = i;
+  }
+
+  /* each count now points at the start of its successor, so bucket b ends
+     where its last block's count points */
+  cilk_for (long b = 0; b < INPUT_BUCKETS; ++b) {
+    long lo = b ? count[b * nblocks - 1] : 0;
+    long hi = count[(b + 1) * nblocks - 1];
+    uint32_t w[4];
+    for (long j = hi - lo - 1, d = 0; j > 0; --j, ++d) {
+      if (d % 4 == 0)
+        philox(seed, b + 1, d / 4, w);
+      long k = rand_below(w[d % 4], j + 1);
+      INPUT_ELM t = a[lo + j];
+      a[lo + j] = a[lo + k];
+      a[lo + k] = t;
+    }
+  }
+
+  free(count);
+  free(bucket);
+}
+
+/*
+ * Run r holds the keys congruent to r modulo nruns, in ascending order;
+ * the first n % nruns runs are one key longer than the others.
+ */
+static inline void runs_order(INPUT_ELM *a, long n, long nruns) {
+
+  long q = n / nruns, rem = n % nruns, split = rem * (q + 1);
+
+  cilk_for (long i = 0; i < n; ++i) {
+    long r, j;
+    if (i < split) {
+      r = i / (q + 1);
+      j = i % (q + 1);
+    } else {
+      r = rem + (i - split) / q;
+      j = (i - split) % q;
+    }
+    a[i] = r + j * nruns;
+  }
+}
+
+/*
+ * Sorted, except that in every block of INPUT_BLOCK keys 1% of the keys
+ * are swapped in pairs at positions drawn from the block's own stream.
+ */
+static inline void nearly_order(INPUT_ELM *a, long n, uint64_t seed) {
+
+  long nblocks = (n + INPUT_BLOCK - 1) / INPUT_BLOCK;
+
+  cilk_for (long blk = 0; blk < nblocks; ++blk) {
+    long lo = blk * INPUT_BLOCK;
+    long len = n - lo < INPUT_BLOCK ? n - lo : INPUT_BLOCK;
+    uint32_t w[4];
+    for (long i = lo; i < lo + len; ++i)
+      a[i] = i;
+    for (long s = 0; s < len / 100; ++s) {
+      philox(seed, blk + 1, s, w);
+      long x = lo + rand_below(w[0], len), y = lo + rand_below(w[1], len);
+      INPUT_ELM t = a[x];
+      a[x] = a[y];
+      a[y] = t;
+    }
+  }
+}
+
+#endif
+#endif
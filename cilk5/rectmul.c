@@ -1,7 +1,9 @@
 /*
- * Program to multiply two rectangualar matrizes A(n,m) * B(m,n), where
- * (n < m) and (n mod 16 = 0) and (m mod n = 0). (Otherwise fill with 0s
- * to fit the shape.)
+ * Program to multiply two rectangualar matrizes A(x,y) * B(y,z).  The
+ * matrices are converted from row-major to a layout of 16 x 16 blocks,
+ * padded with 0s to fit the shape, and the product converted back.  The
+ * blocks are stored either in rows or in Z (Morton) order within square
+ * tiles, where each quadrant the recursion reaches is contiguous.
  *
  * written by Harald Prokop (prokop@mit.edu) Fall 97.
  */
@@ -30,6 +32,7 @@
 #include <cilk/cilk.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 
 #ifdef SERIAL
@@ -40,7 +43,23 @@ unsigned long long todval(struct timeval *tp) {
   return tp->tv_sec * 1000 * 1000 + tp->tv_usec;
 }
 
+/*
+ * Block kernels: compute R = AB, or R = R + AB if add is set, where R, A
+ * and B are BLOCK_EDGE x BLOCK_EDGE row-major blocks, and return the
+ * number of flops.  The scalar kernel works on 2 x 2 register tiles.  On
+ * x86-64 there are also FMA kernels on 4 x 8 tiles with AVX2 and 8 x 16
+ * tiles with AVX-512, each accumulating a tile of R in vector registers
+ * while streaming rows of B.  They are compiled for their ISA with target
+ * attributes, so one binary carries all of them, and select_kernel picks
+ * the widest one the CPU supports at startup.  BLOCK_EDGE may be set at
+ * compile time to any multiple of 16.
+ */
+#ifndef BLOCK_EDGE
 #define BLOCK_EDGE 16
+#endif
+#if BLOCK_EDGE % 16 != 0
+#error "BLOCK_EDGE must be a multiple of 16"
+#endif
 #define BLOCK_SIZE (BLOCK_EDGE * BLOCK_EDGE)
 
 typedef double DTYPE;
@@ -48,6 +67,8 @@ typedef double DTYPE;
 typedef DTYPE block[BLOCK_SIZE];
 typedef block *pblock;
 
+typedef long long (*block_kernel)(block *A, block *B, block *R, int add);
+
 /*
 double min;
 double max;
@@ -55,244 +76,145 @@ int count;
 double sum;
 */
 
-/* compute R = R+AB, where R,A,B are BLOCK_EDGE x BLOCK_EDGE matricies
- */
-long long mult_add_block(block *A, block *B, block *R) {
+/* the flops of R = AB, and of R = R + AB */
+#define BLOCK_FLOPS(add)                                                       \
+  ((add) ? 2LL * BLOCK_EDGE * BLOCK_SIZE                                       \
+         : 2LL * BLOCK_EDGE * BLOCK_SIZE - BLOCK_SIZE)
 
-  long long flops = 0LL;
+long long block_scalar(block *A, block *B, block *R, int add) {
 
-  for (int j = 0; j < 16; j += 2) { /* 2 columns at a time */
+  for (int j = 0; j < BLOCK_EDGE; j += 2) { /* 2 columns at a time */
     DTYPE *bp = &((DTYPE *)B)[j];
-    for (int i = 0; i < 16; i += 2) { /* 2 rows at a time */
-      DTYPE *ap = &((DTYPE *)A)[i * 16];
-      DTYPE *rp = &((DTYPE *)R)[j + i * 16];
-      DTYPE s0_0, s0_1;
-      DTYPE s1_0, s1_1;
-      s0_0 = rp[0];
-      s0_1 = rp[1];
-      s1_0 = rp[16];
-      s1_1 = rp[17];
-      s0_0 += ap[0] * bp[0];
-      s0_1 += ap[0] * bp[1];
-      s1_0 += ap[16] * bp[0];
-      s1_1 += ap[16] * bp[1];
-      s0_0 += ap[1] * bp[16];
-      s0_1 += ap[1] * bp[17];
-      s1_0 += ap[17] * bp[16];
-      s1_1 += ap[17] * bp[17];
-      s0_0 += ap[2] * bp[32];
-      s0_1 += ap[2] * bp[33];
-      s1_0 += ap[18] * bp[32];
-      s1_1 += ap[18] * bp[33];
-      s0_0 += ap[3] * bp[48];
-      s0_1 += ap[3] * bp[49];
-      s1_0 += ap[19] * bp[48];
-      s1_1 += ap[19] * bp[49];
-      s0_0 += ap[4] * bp[64];
-      s0_1 += ap[4] * bp[65];
-      s1_0 += ap[20] * bp[64];
-      s1_1 += ap[20] * bp[65];
-      s0_0 += ap[5] * bp[80];
-      s0_1 += ap[5] * bp[81];
-      s1_0 += ap[21] * bp[80];
-      s1_1 += ap[21] * bp[81];
-      s0_0 += ap[6] * bp[96];
-      s0_1 += ap[6] * bp[97];
-      s1_0 += ap[22] * bp[96];
-      s1_1 += ap[22] * bp[97];
-      s0_0 += ap[7] * bp[112];
-      s0_1 += ap[7] * bp[113];
-      s1_0 += ap[23] * bp[112];
-      s1_1 += ap[23] * bp[113];
-      s0_0 += ap[8] * bp[128];
-      s0_1 += ap[8] * bp[129];
-      s1_0 += ap[24] * bp[128];
-      s1_1 += ap[24] * bp[129];
-      s0_0 += ap[9] * bp[144];
-      s0_1 += ap[9] * bp[145];
-      s1_0 += ap[25] * bp[144];
-      s1_1 += ap[25] * bp[145];
-      s0_0 += ap[10] * bp[160];
-      s0_1 += ap[10] * bp[161];
-      s1_0 += ap[26] * bp[160];
-      s1_1 += ap[26] * bp[161];
-      s0_0 += ap[11] * bp[176];
-      s0_1 += ap[11] * bp[177];
-      s1_0 += ap[27] * bp[176];
-      s1_1 += ap[27] * bp[177];
-      s0_0 += ap[12] * bp[192];
-      s0_1 += ap[12] * bp[193];
-      s1_0 += ap[28] * bp[192];
-      s1_1 += ap[28] * bp[193];
-      s0_0 += ap[13] * bp[208];
-      s0_1 += ap[13] * bp[209];
-      s1_0 += ap[29] * bp[208];
-      s1_1 += ap[29] * bp[209];
-      s0_0 += ap[14] * bp[224];
-      s0_1 += ap[14] * bp[225];
-      s1_0 += ap[30] * bp[224];
-      s1_1 += ap[30] * bp[225];
-      s0_0 += ap[15] * bp[240];
-      s0_1 += ap[15] * bp[241];
-      s1_0 += ap[31] * bp[240];
-      s1_1 += ap[31] * bp[241];
+    for (int i = 0; i < BLOCK_EDGE; i += 2) { /* 2 rows at a time */
+      DTYPE *ap = &((DTYPE *)A)[i * BLOCK_EDGE];
+      DTYPE *rp = &((DTYPE *)R)[j + i * BLOCK_EDGE];
+      DTYPE s0_0 = 0, s0_1 = 0;
+      DTYPE s1_0 = 0, s1_1 = 0;
+      if (add) {
+        s0_0 = rp[0];
+        s0_1 = rp[1];
+        s1_0 = rp[BLOCK_EDGE];
+        s1_1 = rp[BLOCK_EDGE + 1];
+      }
+      for (int k = 0; k < BLOCK_EDGE; k++) {
+        s0_0 += ap[k] * bp[k * BLOCK_EDGE];
+        s0_1 += ap[k] * bp[k * BLOCK_EDGE + 1];
+        s1_0 += ap[BLOCK_EDGE + k] * bp[k * BLOCK_EDGE];
+        s1_1 += ap[BLOCK_EDGE + k] * bp[k * BLOCK_EDGE + 1];
+      }
       rp[0] = s0_0;
       rp[1] = s0_1;
-      rp[16] = s1_0;
-      rp[17] = s1_1;
-      flops += 128;
+      rp[BLOCK_EDGE] = s1_0;
+      rp[BLOCK_EDGE + 1] = s1_1;
     }
   }
 
-  return flops;
+  return BLOCK_FLOPS(add);
 }
 
-/* compute R = AB, where R,A,B are BLOCK_EDGE x BLOCK_EDGE matricies
- */
-long long multiply_block(block *A, block *B, block *R) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_SIMD_KERNELS
 
-  long long flops = 0LL;
+__attribute__((target("avx2,fma"))) long long
+block_avx2(block *A, block *B, block *R, int add) {
 
-  for (int j = 0; j < 16; j += 2) { /* 2 columns at a time */
-    DTYPE *bp = &((DTYPE *)B)[j];
-    for (int i = 0; i < 16; i += 2) { /* 2 rows at a time */
-      DTYPE *ap = &((DTYPE *)A)[i * 16];
-      DTYPE *rp = &((DTYPE *)R)[j + i * 16];
-      DTYPE s0_0, s0_1;
-      DTYPE s1_0, s1_1;
-      s0_0 = ap[0] * bp[0];
-      s0_1 = ap[0] * bp[1];
-      s1_0 = ap[16] * bp[0];
-      s1_1 = ap[16] * bp[1];
-      s0_0 += ap[1] * bp[16];
-      s0_1 += ap[1] * bp[17];
-      s1_0 += ap[17] * bp[16];
-      s1_1 += ap[17] * bp[17];
-      s0_0 += ap[2] * bp[32];
-      s0_1 += ap[2] * bp[33];
-      s1_0 += ap[18] * bp[32];
-      s1_1 += ap[18] * bp[33];
-      s0_0 += ap[3] * bp[48];
-      s0_1 += ap[3] * bp[49];
-      s1_0 += ap[19] * bp[48];
-      s1_1 += ap[19] * bp[49];
-      s0_0 += ap[4] * bp[64];
-      s0_1 += ap[4] * bp[65];
-      s1_0 += ap[20] * bp[64];
-      s1_1 += ap[20] * bp[65];
-      s0_0 += ap[5] * bp[80];
-      s0_1 += ap[5] * bp[81];
-      s1_0 += ap[21] * bp[80];
-      s1_1 += ap[21] * bp[81];
-      s0_0 += ap[6] * bp[96];
-      s0_1 += ap[6] * bp[97];
-      s1_0 += ap[22] * bp[96];
-      s1_1 += ap[22] * bp[97];
-      s0_0 += ap[7] * bp[112];
-      s0_1 += ap[7] * bp[113];
-      s1_0 += ap[23] * bp[112];
-      s1_1 += ap[23] * bp[113];
-      s0_0 += ap[8] * bp[128];
-      s0_1 += ap[8] * bp[129];
-      s1_0 += ap[24] * bp[128];
-      s1_1 += ap[24] * bp[129];
-      s0_0 += ap[9] * bp[144];
-      s0_1 += ap[9] * bp[145];
-      s1_0 += ap[25] * bp[144];
-      s1_1 += ap[25] * bp[145];
-      s0_0 += ap[10] * bp[160];
-      s0_1 += ap[10] * bp[161];
-      s1_0 += ap[26] * bp[160];
-      s1_1 += ap[26] * bp[161];
-      s0_0 += ap[11] * bp[176];
-      s0_1 += ap[11] * bp[177];
-      s1_0 += ap[27] * bp[176];
-      s1_1 += ap[27] * bp[177];
-      s0_0 += ap[12] * bp[192];
-      s0_1 += ap[12] * bp[193];
-      s1_0 += ap[28] * bp[192];
-      s1_1 += ap[28] * bp[193];
-      s0_0 += ap[13] * bp[208];
-      s0_1 += ap[13] * bp[209];
-      s1_0 += ap[29] * bp[208];
-      s1_1 += ap[29] * bp[209];
-      s0_0 += ap[14] * bp[224];
-      s0_1 += ap[14] * bp[225];
-      s1_0 += ap[30] * bp[224];
-      s1_1 += ap[30] * bp[225];
-      s0_0 += ap[15] * bp[240];
-      s0_1 += ap[15] * bp[241];
-      s1_0 += ap[31] * bp[240];
-      s1_1 += ap[31] * bp[241];
-      rp[0] = s0_0;
-      rp[1] = s0_1;
-      rp[16] = s1_0;
-      rp[17] = s1_1;
-      flops += 124;
-    }
-  }
-
-  return flops;
-}
+  const DTYPE *a = (DTYPE *)A, *b = (DTYPE *)B;
+  DTYPE *r = (DTYPE *)R;
 
-/* Checks if each A[i,j] of a martix A of size nb x nb blocks has value v
- */
-int check_block(block *R, DTYPE v) {
-
-  int error = 0;
-
-  // fprintf(stderr, "R: %lx.\n", R);
-  for (int i = 0; i < BLOCK_SIZE; i++)
-    if (((DTYPE *)R)[i] != v) {
-      if (i == 0)
-        fprintf(stderr, "R[%d]: %lf != %lf.\n", i, ((DTYPE *)R)[i], v);
-      // return 1;
-      error++;
+  for (int i = 0; i < BLOCK_EDGE; i += 4)   /* 4 rows */
+    for (int j = 0; j < BLOCK_EDGE; j += 8) { /* by 8 columns */
+      __m256d c[4][2];
+      for (int s = 0; s < 4; s++) {
+        DTYPE *rp = r + (i + s) * BLOCK_EDGE + j;
+        c[s][0] = add ? _mm256_loadu_pd(rp) : _mm256_setzero_pd();
+        c[s][1] = add ? _mm256_loadu_pd(rp + 4) : _mm256_setzero_pd();
+      }
+      for (int k = 0; k < BLOCK_EDGE; k++) {
+        __m256d b0 = _mm256_loadu_pd(b + k * BLOCK_EDGE + j);
+        __m256d b1 = _mm256_loadu_pd(b + k * BLOCK_EDGE + j + 4);
+        for (int s = 0; s < 4; s++) {
+          __m256d as = _mm256_broadcast_sd(a + (i + s) * BLOCK_EDGE + k);
+          c[s][0] = _mm256_fmadd_pd(as, b0, c[s][0]);
+          c[s][1] = _mm256_fmadd_pd(as, b1, c[s][1]);
+        }
+      }
+      for (int s = 0; s < 4; s++) {
+        DTYPE *rp = r + (i + s) * BLOCK_EDGE + j;
+        _mm256_storeu_pd(rp, c[s][0]);
+        _mm256_storeu_pd(rp + 4, c[s][1]);
+      }
     }
 
-  return error;
+  return BLOCK_FLOPS(add);
 }
 
-int compare_block(block *R, block *B) {
+__attribute__((target("avx512f"))) long long
+block_avx512(block *A, block *B, block *R, int add) {
 
-  int error = 0;
+  const DTYPE *a = (DTYPE *)A, *b = (DTYPE *)B;
+  DTYPE *r = (DTYPE *)R;
 
-  // fprintf(stderr, "R: %lx.\n", R);
-  for (int i = 0; i < BLOCK_SIZE; i++)
-    if (((DTYPE *)R)[i] != ((DTYPE *)B)[i]) {
-      if (i == 0)
-        fprintf(stderr, "(R[%d]) %lf != %lf (B[%d]).\n", i, ((DTYPE *)R)[i],
-                ((DTYPE *)B)[i], i);
-      // return 1;
-      error++;
+  for (int i = 0; i < BLOCK_EDGE; i += 8)    /* 8 rows */
+    for (int j = 0; j < BLOCK_EDGE; j += 16) { /* by 16 columns */
+      __m512d c[8][2];
+      for (int s = 0; s < 8; s++) {
+        DTYPE *rp = r + (i + s) * BLOCK_EDGE + j;
+        c[s][0] = add ? _mm512_loadu_pd(rp) : _mm512_setzero_pd();
+        c[s][1] = add ? _mm512_loadu_pd(rp + 8) : _mm512_setzero_pd();
+      }
+      for (int k = 0; k < BLOCK_EDGE; k++) {
+        __m512d b0 = _mm512_loadu_pd(b + k * BLOCK_EDGE + j);
+        __m512d b1 = _mm512_loadu_pd(b + k * BLOCK_EDGE + j + 8);
+        for (int s = 0; s < 8; s++) {
+          __m512d as = _mm512_set1_pd(a[(i + s) * BLOCK_EDGE + k]);
+          c[s][0] = _mm512_fmadd_pd(as, b0, c[s][0]);
+          c[s][1] = _mm512_fmadd_pd(as, b1, c[s][1]);
+        }
+      }
+      for (int s = 0; s < 8; s++) {
+        DTYPE *rp = r + (i + s) * BLOCK_EDGE + j;
+        _mm512_storeu_pd(rp, c[s][0]);
+        _mm512_storeu_pd(rp + 8, c[s][1]);
+      }
     }
 
-  return error;
+  return BLOCK_FLOPS(add);
 }
+#endif
 
-int check_matrix(block *R, long x, long y, long o, DTYPE v) {
-
-  int a = 0, b = 0;
+block_kernel mult_block = block_scalar;
+const char *kernel_name = "scalar";
 
-  if ((x * y) == 1) {
-    int tmp = check_block(R, v);
-    return tmp;
-  }
+/*
+ * Use the kernel named name, or if name is "auto", the widest one this
+ * CPU supports.  Returns 0 if the kernel named is not available.
+ */
+int select_kernel(const char *name) {
 
-  cilk_scope {
-    if (x > y) {
-      a = cilk_spawn check_matrix(R, x / 2, y, o, v);
-      b = check_matrix(R + (x / 2) * o, (x + 1) / 2, y, o, v);
+  int any = !strcmp(name, "auto");
 
-    } else {
-      a = cilk_spawn check_matrix(R, x, y / 2, o, v);
-      b = check_matrix(R + (y / 2), x, (y + 1) / 2, o, v);
-    }
+#ifdef HAVE_SIMD_KERNELS
+  __builtin_cpu_init();
+  if ((any || !strcmp(name, "avx512")) && __builtin_cpu_supports("avx512f")) {
+    mult_block = block_avx512;
+    kernel_name = "avx512";
+    return 1;
+  }
+  if ((any || !strcmp(name, "avx2")) && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("fma")) {
+    mult_block = block_avx2;
+    kernel_name = "avx2";
+    return 1;
+  }
+#endif
+  if (any || !strcmp(name, "scalar")) {
+    mult_block = block_scalar;
+    kernel_name = "scalar";
+    return 1;
   }
 
-  int _tmp3 = a + b;
-
-  return (_tmp3);
+  return 0;
 }
 
 long long add_block(block *T, block *R) {
@@ -365,17 +287,139 @@ void init_matrix(block *R, long x, long y, long o, DTYPE v) {
   return;
 }
 
+/*
+ * Conversion between row-major matrices and the blocked layouts.  The
+ * row layout stores a matrix of x by y blocks as rows of y blocks.  The
+ * Morton layout cuts it into square tiles of s by s blocks, s a power of
+ * 2, stores the tiles as rows of tiles, and the blocks of each tile in
+ * Z order, so that every aligned square of blocks whose edge is a power
+ * of 2 up to s is contiguous.  The row layout is the Morton layout with
+ * s = 1.  Blocks are row-major in both.  A rows x cols matrix with leading
+ * dimension ld takes ceil(rows / BLOCK_EDGE) by ceil(cols / BLOCK_EDGE)
+ * blocks, rounded up to multiples of s; the blocks on its bottom and
+ * right edges are padded with zeros, which leave the product unchanged.
+ * Both directions convert blocks in parallel.
+ */
+static void pack_block(const DTYPE *M, long rows, long cols, long ld,
+                       block *P, long bi, long bj) {
+
+  DTYPE *p = (DTYPE *)P;
+  long c0 = bj * BLOCK_EDGE;
+  long n = cols - c0 < BLOCK_EDGE ? cols - c0 : BLOCK_EDGE;
+
+  if (n < 0)
+    n = 0;
+
+  for (int i = 0; i < BLOCK_EDGE; i++) {
+    long r = bi * BLOCK_EDGE + i;
+    long len = r < rows ? n : 0;
+    if (len > 0)
+      memcpy(p + i * BLOCK_EDGE, M + r * ld + c0, len * sizeof(DTYPE));
+    memset(p + i * BLOCK_EDGE + len, 0, (BLOCK_EDGE - len) * sizeof(DTYPE));
+  }
+}
+
+static void unpack_block(const block *P, DTYPE *M, long rows, long cols,
+                         long ld, long bi, long bj) {
+
+  const DTYPE *p = (const DTYPE *)P;
+  long c0 = bj * BLOCK_EDGE;
+  long n = cols - c0 < BLOCK_EDGE ? cols - c0 : BLOCK_EDGE;
+
+  if (n <= 0)
+    return;
+
+  for (int i = 0; i < BLOCK_EDGE && bi * BLOCK_EDGE + i < rows; i++)
+    memcpy(M + (bi * BLOCK_EDGE + i) * ld + c0, p + i * BLOCK_EDGE,
+           n * sizeof(DTYPE));
+}
+
+/* the number of blocks needed to cover n rows or columns, in tiles of s */
+long blocks_for(long n, long s) {
+  return ((n + BLOCK_EDGE - 1) / BLOCK_EDGE + s - 1) / s * s;
+}
+
+/* interleave the bits of i and j, those of i going to the odd bits */
+static long interleave(long i, long j) {
+
+  long z = 0;
+
+  for (int b = 0; (1L << b) <= (i | j); b++)
+    z |= ((i >> b) & 1) << (2 * b + 1) | ((j >> b) & 1) << (2 * b);
+  return z;
+}
+
+/* the index of block (bi, bj) of a matrix of by block columns */
+static long block_index(long bi, long bj, long by, long s) {
+  return ((bi / s) * (by / s) + bj / s) * s * s + interleave(bi % s, bj % s);
+}
+
+/* copy row-major M into P, in tiles of s by s blocks */
+void to_blocks(const DTYPE *M, long rows, long cols, long ld, block *P,
+               long s) {
+
+  long by = blocks_for(cols, s);
+
+  cilk_for (long b = 0; b < blocks_for(rows, s) * by; b++)
+    pack_block(M, rows, cols, ld, P + block_index(b / by, b % by, by, s),
+               b / by, b % by);
+}
+
+/* copy the rows x cols matrix held in P back into row-major M */
+void from_blocks(const block *P, DTYPE *M, long rows, long cols, long ld,
+                 long s) {
+
+  long by = blocks_for(cols, s);
+
+  cilk_for (long b = 0; b < blocks_for(rows, s) * by; b++)
+    unpack_block(P + block_index(b / by, b % by, by, s), M, rows, cols, ld,
+                 b / by, b % by);
+}
+
+/*
+ * R = AB, or R = R + AB if add is set, for s by s tiles of blocks in Z
+ * order: the quadrants of each tile are contiguous, so the recursion
+ * multiplies them in two rounds of four independent products.
+ */
+static long long multiply_tile(block *A, block *B, block *R, long s,
+                               int add) {
+
+  if (s == 1)
+    return mult_block(A, B, R, add);
+
+  long q = (s / 2) * (s / 2); /* blocks per quadrant */
+  long long f0 = 0LL, f1 = 0LL, f2 = 0LL, f3 = 0LL;
+  long long g0 = 0LL, g1 = 0LL, g2 = 0LL, g3 = 0LL;
+
+  cilk_scope {
+    f0 = cilk_spawn multiply_tile(A, B, R, s / 2, add);
+    f1 = cilk_spawn multiply_tile(A, B + q, R + q, s / 2, add);
+    f2 = cilk_spawn multiply_tile(A + 2 * q, B, R + 2 * q, s / 2, add);
+    f3 = multiply_tile(A + 2 * q, B + q, R + 3 * q, s / 2, add);
+  }
+  cilk_scope {
+    g0 = cilk_spawn multiply_tile(A + q, B + 2 * q, R, s / 2, 1);
+    g1 = cilk_spawn multiply_tile(A + q, B + 3 * q, R + q, s / 2, 1);
+    g2 = cilk_spawn multiply_tile(A + 3 * q, B + 2 * q, R + 2 * q, s / 2, 1);
+    g3 = multiply_tile(A + 3 * q, B + 3 * q, R + 3 * q, s / 2, 1);
+  }
+
+  return f0 + f1 + f2 + f3 + g0 + g1 + g2 + g3;
+}
+
+/*
+ * R = AB, or R = R + AB if add is set, for x by y A and y by z B, in
+ * units of s by s tiles of blocks; oa, ob and orr are the strides between
+ * rows of tiles, in blocks.
+ */
 static long long multiply_matrix(block *A, long oa, block *B, long ob, long x,
-                                 long y, long z, block *R, long orr, int add) {
+                                 long y, long z, block *R, long orr, long s,
+                                 int add) {
 
-  if ((x + y + z) == 3) {
-    long long _tmp = 0LL;
-    if (add)
-      _tmp = mult_add_block(A, B, R);
-    else
-      _tmp = multiply_block(A, B, R);
+  long t = s * s; /* blocks per tile */
 
-    return _tmp;
+  if ((x + y + z) == 3) {
+    return multiply_tile(A, B, R, s, add);
   }
 
   long long flops = 0LL;
@@ -383,22 +427,22 @@ static long long multiply_matrix(block *A, long oa, block *B, long ob, long x,
 
   cilk_scope {
     if ((x >= y) && (x >= z)) {
-      _tmp1 =
-          cilk_spawn multiply_matrix(A, oa, B, ob, x / 2, y, z, R, orr, add);
+      _tmp1 = cilk_spawn multiply_matrix(A, oa, B, ob, x / 2, y, z, R, orr,
+                                         s, add);
       _tmp2 = multiply_matrix(A + (x / 2) * oa, oa, B, ob, (x + 1) / 2, y, z,
-                              R + (x / 2) * orr, orr, add);
+                              R + (x / 2) * orr, orr, s, add);
     } else {
 
       if ((y > x) && (y > z)) {
-        _tmp1 = multiply_matrix(A + (y / 2), oa, B + (y / 2) * ob, ob, x,
-                                (y + 1) / 2, z, R, orr, add);
-        _tmp2 = multiply_matrix(A, oa, B, ob, x, y / 2, z, R, orr, 1);
+        _tmp1 = multiply_matrix(A + (y / 2) * t, oa, B + (y / 2) * ob, ob, x,
+                                (y + 1) / 2, z, R, orr, s, add);
+        _tmp2 = multiply_matrix(A, oa, B, ob, x, y / 2, z, R, orr, s, 1);
 
       } else {
-        _tmp1 =
-            cilk_spawn multiply_matrix(A, oa, B, ob, x, y, z / 2, R, orr, add);
-        _tmp2 = multiply_matrix(A, oa, B + (z / 2), ob, x, y, (z + 1) / 2,
-                                (R + (z / 2)), orr, add);
+        _tmp1 = cilk_spawn multiply_matrix(A, oa, B, ob, x, y, z / 2, R, orr,
+                                           s, add);
+        _tmp2 = multiply_matrix(A, oa, B + (z / 2) * t, ob, x, y, (z + 1) / 2,
+                                (R + (z / 2) * t), orr, s, add);
       }
     }
   }
@@ -407,30 +451,116 @@ static long long multiply_matrix(block *A, long oa, block *B, long ob, long x,
   return flops;
 }
 
-int run(long x, long y, long z, int check) {
+/*
+ * Values of the test matrices: A(i, j) = i + 1 + j and B(j, k) = k + 1 + j.
+ * No two rows or columns of either are equal, so a row or column that a
+ * conversion moves changes the product, unless the inner dimension of A
+ * and B is permuted alike, which leaves the product as it is.  With S1 and
+ * S2 the sums of j and j * j over j < ny,
+ *   R(i, k) = ny * (i + 1) * (k + 1) + (i + k + 2) * S1 + S2,
+ * which is exact as long as it stays below 2^53.
+ */
+#define A_VAL(i, j) ((DTYPE)((i) + 1 + (j)))
+#define B_VAL(j, k) ((DTYPE)((k) + 1 + (j)))
+
+/* count the elements of the nx x nz row-major R that are not as expected */
+long check_rowmajor(const DTYPE *R, long nx, long ny, long nz) {
 
+  long errors = 0, s1 = 0, s2 = 0;
+
+  for (long j = 0; j < ny; j++) {
+    s1 += j;
+    s2 += j * j;
+  }
+  for (long i = 0; i < nx; i++)
+    for (long k = 0; k < nz; k++) {
+      long v = ny * (i + 1) * (k + 1) + (i + k + 2) * s1 + s2;
+      if (R[i * nz + k] != (DTYPE)v) {
+        if (!errors)
+          fprintf(stderr, "R[%ld][%ld]: %lf != %ld.\n", i, k, R[i * nz + k],
+                  v);
+        errors++;
+      }
+    }
+
+  return errors;
+}
+
+/* the padding of n elements to tiles of s blocks stays within 1/8 */
+static int pads_well(long n, long s) {
+  return blocks_for(n, s) <= blocks_for(n, 1) + blocks_for(n, 1) / 8;
+}
+
+/*
+ * The tile edge for the Morton layout: the largest power of 2 that is no
+ * bigger than the smallest dimension, in blocks, and pads none of them by
+ * more than 1/8.
+ */
+long tile_for(long nx, long ny, long nz) {
+
+  long n = blocks_for(nx, 1), s = 1;
+
+  if (blocks_for(ny, 1) < n)
+    n = blocks_for(ny, 1);
+  if (blocks_for(nz, 1) < n)
+    n = blocks_for(nz, 1);
+  while (2 * s <= n)
+    s *= 2;
+  while (s > 1 && !(pads_well(nx, s) && pads_well(ny, s) && pads_well(nz, s)))
+    s /= 2;
+  return s;
+}
+
+/*
+ * Multiply the row-major nx x ny A by the row-major ny x nz B: convert
+ * both to blocks, multiply, and convert the product back, timing the
+ * conversions separately from the multiply.
+ */
+int run(long nx, long ny, long nz, int morton, int check) {
+
+  long s = morton ? tile_for(nx, ny, nz) : 1;
+  long x = blocks_for(nx, s), y = blocks_for(ny, s), z = blocks_for(nz, s);
+  DTYPE *Am = (DTYPE *)malloc(nx * ny * sizeof(DTYPE));
+  DTYPE *Bm = (DTYPE *)malloc(ny * nz * sizeof(DTYPE));
+  DTYPE *Rm = (DTYPE *)malloc(nx * nz * sizeof(DTYPE));
   block *A = (block *)malloc(x * y * sizeof(block));
   block *B = (block *)malloc(y * z * sizeof(block));
   block *R = (block *)malloc(x * z * sizeof(block));
 
+  cilk_for (long i = 0; i < nx; i++)
+    for (long j = 0; j < ny; j++)
+      Am[i * ny + j] = A_VAL(i, j);
+  cilk_for (long j = 0; j < ny; j++)
+    for (long k = 0; k < nz; k++)
+      Bm[j * nz + k] = B_VAL(j, k);
+  init_matrix(R, x, z, z, 0.0);
+
+  struct timeval t1, t2;
+  gettimeofday(&t1, 0);
   cilk_scope {
-    cilk_spawn init_matrix(A, x, y, y, 1.0);
-    cilk_spawn init_matrix(B, y, z, z, 1.0);
-    init_matrix(R, x, z, z, 0.0);
+    cilk_spawn to_blocks(Am, nx, ny, ny, A, s);
+    to_blocks(Bm, ny, nz, nz, B, s);
   }
+  gettimeofday(&t2, 0);
+  unsigned long long convert_in_us = todval(&t2) - todval(&t1);
 
-  struct timeval t1, t2;
   gettimeofday(&t1, 0);
 
-  long long flops = multiply_matrix(A, y, B, z, x, y, z, R, z, 0);
+  long long flops = multiply_matrix(A, y * s, B, z * s, x / s, y / s, z / s,
+                                    R, z * s, s, 0);
 
   gettimeofday(&t2, 0);
-  unsigned long long runtime_ms = (todval(&t2) - todval(&t1)) / 1000;
-  printf("%f\n", runtime_ms / 1000.0);
+  unsigned long long runtime_us = todval(&t2) - todval(&t1);
+  printf("%f\n", runtime_us / 1000000.0);
+
+  gettimeofday(&t1, 0);
+  from_blocks(R, Rm, nx, nz, nz, s);
+  gettimeofday(&t2, 0);
+  unsigned long long convert_out_us = todval(&t2) - todval(&t1);
 
   if (check) {
     printf("Now check result ... \n");
-    check = check_matrix(R, x, z, z, y * 16);
+    check = check_rowmajor(Rm, nx, ny, nz) != 0;
   }
 
   if (check) {
@@ -439,36 +569,57 @@ int run(long x, long y, long z, int check) {
 
   } else {
     fprintf(stderr, "\nCilk Example: rectmul\n");
-    fprintf(stderr, "Options: x = %ld\n", BLOCK_EDGE * x);
-    fprintf(stderr, "         y = %ld\n", BLOCK_EDGE * y);
-    fprintf(stderr, "         z = %ld\n\n", BLOCK_EDGE * z);
-    // fprintf(stderr, "flops      = %lld\n", flops);
-    //  printf("Mflops     = %4f \n", f);
+    fprintf(stderr, "Options: x = %ld\n", nx);
+    fprintf(stderr, "         y = %ld\n", ny);
+    fprintf(stderr, "         z = %ld\n\n", nz);
+    fprintf(stderr, "flops      = %lld\n", flops);
+    fprintf(stderr, "GFLOP/s    = %.2f (%s kernel, block edge %d)\n",
+            flops / (runtime_us * 1000.0), kernel_name, BLOCK_EDGE);
+    fprintf(stderr, "conversion = %f s to blocks, %f s back\n",
+            convert_in_us / 1000000.0, convert_out_us / 1000000.0);
+    if (morton)
+      fprintf(stderr, "layout     = morton, %ld x %ld block tiles\n", s, s);
+    else
+      fprintf(stderr, "layout     = rows\n");
   }
 
   free(A);
   free(B);
   free(R);
+  free(Am);
+  free(Bm);
+  free(Rm);
 
   return 0;
 }
 
 int usage(void) {
   fprintf(stderr, "Program to multiply two rectangualar matrizes "
-                  "A(n,m) * B(m,n), where \n");
-  fprintf(stderr, "(n < m) and (n mod 16 = 0) and (m mod n = 0). "
-                  "(Otherwise fill with 0s \n to fit the shape.)\n");
+                  "A(x,y) * B(y,z) of any shape.\n");
+  fprintf(stderr, "They are converted to blocks of %d x %d, padded "
+                  "with 0s to fit the shape.\n",
+          BLOCK_EDGE, BLOCK_EDGE);
   fprintf(stderr, "Usage: rectmul [<cilk-options>] [<options>]\n\n");
   fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -x, -y, -z : Dimensions of A and B.\n");
   fprintf(stderr, "  -c   : Check result.\n");
+  fprintf(stderr, "  -kernel auto / scalar / avx2 / avx512 : block kernel, "
+                  "by default the\n"
+                  "         widest one the CPU supports.\n");
+  fprintf(stderr, "  -layout rows / morton : order of the blocks, rows of "
+                  "blocks by default,\n"
+                  "         or Z order within the largest square tiles "
+                  "that fit.\n");
   fprintf(stderr, "-benchmark short / medium / long.\n");
   fprintf(stderr, "Default benchmark size: medium (512 * 512).\n\n");
 
   return 1;
 }
 
-const char *specifiers[] = {"-x", "-y", "-z", "-c", "-benchmark", "-h", 0};
-int opt_types[] = {INTARG, INTARG, INTARG, BOOLARG, BENCHMARK, BOOLARG, 0};
+const char *specifiers[] = {"-x", "-y", "-z",      "-c",
+                            "-benchmark", "-h", "-kernel", "-layout", 0};
+int opt_types[] = {INTARG,    INTARG,  INTARG,    BOOLARG,
+                   BENCHMARK, BOOLARG, STRINGARG, STRINGARG, 0};
 
 int main(int argc, char *argv[]) {
 
@@ -479,13 +630,25 @@ int main(int argc, char *argv[]) {
   int y = 128;
   int z = 128;
   int check = 0;
+  char kernel[64] = "auto";
+  char layout[64] = "rows";
 
   get_options(argc, argv, specifiers, opt_types, &x, &y, &z, &check, &benchmark,
-              &help);
+              &help, kernel, layout);
 
   if (help)
     return usage();
 
+  if (!select_kernel(kernel)) {
+    fprintf(stderr, "kernel %s is not supported here\n", kernel);
+    return 1;
+  }
+
+  if (strcmp(layout, "rows") != 0 && strcmp(layout, "morton") != 0) {
+    fprintf(stderr, "unknown layout %s\n", layout);
+    return 1;
+  }
+
   if (benchmark) {
     switch (benchmark) {
     case 1: /* short benchmark options -- a little work*/
@@ -506,10 +669,6 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  x = x / BLOCK_EDGE;
-  y = y / BLOCK_EDGE;
-  z = z / BLOCK_EDGE;
-
   if (x < 1)
     x = 1;
   if (y < 1)
@@ -517,7 +676,7 @@ int main(int argc, char *argv[]) {
   if (z < 1)
     z = 1;
 
-  t = run(x, y, z, check);
+  t = run(x, y, z, strcmp(layout, "morton") == 0, check);
 
   return t;
 }
@@ -31,6 +31,10 @@
 #include <stdlib.h>
 #include <sys/time.h>
 
+#ifdef SERIAL
+#include <cilk/cilk_stub.h>
+#endif
+
 unsigned long long todval(struct timeval *tp) {
   return tp->tv_sec * 1000 * 1000 + tp->tv_usec;
 }
@@ -232,7 +236,7 @@ long long multiply_block(block *A, block *B, block *R) {
 
 /* Checks if each A[i,j] of a martix A of size nb x nb blocks has value v
  */
-void check_block(block *R, DTYPE v, int *errorf) {
+int check_block(block *R, DTYPE v) {
 
   int error = 0;
 
@@ -245,7 +249,7 @@ void check_block(block *R, DTYPE v, int *errorf) {
       error++;
     }
 
-  *errorf = 1;
+  return error;
 }
 
 int compare_block(block *R, block *B) {
@@ -265,22 +269,24 @@ int compare_block(block *R, block *B) {
   return error;
 }
 
-void check_matrix(block *R, long x, long y, long o, DTYPE v, int *errorf) {
+int check_matrix(block *R, long x, long y, long o, DTYPE v) {
 
-  if ((x * y) == 1) {
-    check_block(R, v, errorf);
-    return;
-  }
+  int a = 0, b = 0;
+
+  if ((x * y) == 1)
+    return check_block(R, v);
 
   cilk_scope {
     if (x > y) {
-      cilk_spawn check_matrix(R, x / 2, y, o, v, errorf);
-      check_matrix(R + (x / 2) * o, (x + 1) / 2, y, o, v, errorf);
+      a = cilk_spawn check_matrix(R, x / 2, y, o, v);
+      b = check_matrix(R + (x / 2) * o, (x + 1) / 2, y, o, v);
     } else {
-      cilk_spawn check_matrix(R, x, y / 2, o, v, errorf);
-      check_matrix(R + (y / 2), x, (y + 1) / 2, o, v, errorf);
+      a = cilk_spawn check_matrix(R, x, y / 2, o, v);
+      b = check_matrix(R + (y / 2), x, (y + 1) / 2, o, v);
     }
   }
+
+  return a + b;
 }
 
 long long add_block(block *T, block *R) {
@@ -345,6 +351,62 @@ void init_matrix(block *R, long x, long y, long o, DTYPE v) {
   return;
 }
 
+/*
+ * Unlike rectmul, the split of the inner dimension y runs both halves in
+ * parallel, accumulating into R through a matrix-sum reducer.  A view is
+ * a matrix of x by z blocks: the leftmost view is R itself, and other
+ * views start out empty and get a temporary matrix when a strand first
+ * multiplies into them.  A split that is not stolen therefore runs both
+ * halves into R one after the other, as rectmul does, and only a steal
+ * pays for a temporary and its addition.  Reducing a view adds it into
+ * the view on its left and frees it.
+ */
+typedef struct {
+  block *M; /* NULL until the first product into the view */
+  long o, x, z;
+  int add; /* set once M holds a partial sum */
+} sum_view;
+
+void sum_identity(void *view) {
+
+  sum_view *v = (sum_view *)view;
+  v->M = NULL;
+  v->add = 0;
+}
+
+void sum_reduce(void *left, void *right) {
+
+  sum_view *l = (sum_view *)left, *r = (sum_view *)right;
+
+  if (r->M == NULL)
+    return;
+  if (l->M == NULL) {
+    *l = *r;
+    return;
+  }
+  for (long i = 0; i < r->x; i++)
+    for (long k = 0; k < r->z; k++)
+      add_block(r->M + i * r->o + k, l->M + i * l->o + k);
+  free(r->M);
+}
+
+void multiply_matrix(block *A, long oa, block *B, long ob, long x, long y,
+                     long z, block *R, long orr, int add);
+
+/* add A * B, for x by y A and y by z B, into the view v */
+void multiply_into(sum_view *v, block *A, long oa, block *B, long ob, long x,
+                   long y, long z) {
+
+  if (v->M == NULL) {
+    v->M = (block *)malloc(x * z * sizeof(block));
+    v->o = z;
+    v->x = x;
+    v->z = z;
+  }
+  multiply_matrix(A, oa, B, ob, x, y, z, v->M, v->o, v->add);
+  v->add = 1;
+}
+
 void multiply_matrix(block *A, long oa, block *B, long ob, long x, long y,
                      long z, block *R, long orr, int add) {
 
@@ -364,9 +426,12 @@ void multiply_matrix(block *A, long oa, block *B, long ob, long x, long y,
     } else {
 
       if ((y > x) && (y > z)) {
-        multiply_matrix(A + (y / 2), oa, B + (y / 2) * ob, ob, x, (y + 1) / 2,
-                        z, R, orr, add);
-        multiply_matrix(A, oa, B, ob, x, y / 2, z, R, orr, 1);
+        sum_view cilk_reducer(sum_identity, sum_reduce) sum = {R, orr, x, z,
+                                                               add};
+        cilk_spawn multiply_into(&sum, A + (y / 2), oa, B + (y / 2) * ob, ob,
+                                 x, (y + 1) / 2, z);
+        multiply_into(&sum, A, oa, B, ob, x, y / 2, z);
+        cilk_sync; /* before sum goes out of scope */
       } else {
         cilk_spawn multiply_matrix(A, oa, B, ob, x, y, z / 2, R, orr, add);
         multiply_matrix(A, oa, B + (z / 2), ob, x, y, (z + 1) / 2,
@@ -399,8 +464,7 @@ int run(long x, long y, long z, int check) {
 
   if (check) {
     printf("Now check result ... \n");
-    check = 0;
-    check_matrix(R, x, z, z, y * 16, &check);
+    check = check_matrix(R, x, z, z, y * 16);
   }
 
   if (check) {
@@ -408,7 +472,7 @@ int run(long x, long y, long z, int check) {
     printf("check: %d\n", check);
 
   } else {
-    fprintf(stderr, "\nCilk Example: rectmul\n");
+    fprintf(stderr, "\nCilk Example: rectmulred\n");
     fprintf(stderr, "Options: x = %ld\n", BLOCK_EDGE * x);
     fprintf(stderr, "         y = %ld\n", BLOCK_EDGE * y);
     fprintf(stderr, "         z = %ld\n\n", BLOCK_EDGE * z);
@@ -428,7 +492,10 @@ int usage(void) {
                   "A(n,m) * B(m,n), where \n");
   fprintf(stderr, "(n < m) and (n mod 16 = 0) and (m mod n = 0). "
                   "(Otherwise fill with 0s \n to fit the shape.)\n");
-  fprintf(stderr, "Usage: rectmul [<cilk-options>] [<options>]\n\n");
+  fprintf(stderr, "The inner dimension is split in parallel with a "
+                  "reducer; compare with\n"
+                  "rectmul -kernel scalar on shapes with a large y.\n");
+  fprintf(stderr, "Usage: rectmulred [<cilk-options>] [<options>]\n\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "  -c   : Check result.\n");
   fprintf(stderr, "-benchmark short / medium / long.\n");
@@ -30,6 +30,7 @@
 
 #include "getoptions.h"
 #include <cilk/cilk.h>
+#include <cilk/cilk_api.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,13 +48,12 @@ unsigned long long todval(struct timeval *tp) {
 #define RAND_MAX 32767
 #endif
 
-#define SizeAtWhichDivideAndConquerIsMoreEfficient 64
-#define SizeAtWhichNaiveAlgorithmIsMoreEfficient 16
+#define SizeAtWhichStrassenIsMoreEfficient 128
+#define SizeAtWhichNaiveAlgorithmIsMoreEfficient 32
 #define CacheBlockSizeInBytes 32
 
 /* The real numbers we are using --- either double or float */
 typedef double REAL;
-typedef unsigned long PTR;
 
 /* maximum tolerable relative error (for the checking routine) */
 #define EPSILON (1.0E-6)
@@ -118,334 +118,298 @@ void mat_vec_mul(int m, int n, int rw, REAL *A, REAL *V, REAL *P, int add) {
 /*
  * Naive sequential algorithm, for comparison purposes
  */
-void matrixmul(int n, REAL *A, int an, REAL *B, int bn, REAL *C, int cn) {
+void matrixmul(int m, int p, int n, REAL *A, int an, REAL *B, int bn, REAL *C,
+               int cn) {
 
-  for (int i = 0; i < n; ++i)
+  for (int i = 0; i < m; ++i)
     for (int j = 0; j < n; ++j) {
       REAL s = 0.0;
-      for (int k = 0; k < n; ++k)
+      for (int k = 0; k < p; ++k)
         s += ELEM(A, an, i, k) * ELEM(B, bn, k, j);
 
       ELEM(C, cn, i, j) = s;
     }
 }
 
-/*****************************************************************************
-**
-** FastNaiveMatrixMultiply
-**
-** For small to medium sized matrices A, B, and C of size
-** MatrixSize * MatrixSize this function performs the operation
-** C = A x B efficiently.
-**
-** Note MatrixSize must be divisible by 8.
-**
-** INPUT:
-**    C = (*C WRITE) Address of top left element of matrix C.
-**    A = (*A IS READ ONLY) Address of top left element of matrix A.
-**    B = (*B IS READ ONLY) Address of top left element of matrix B.
-**    MatrixSize = Size of matrices (for n*n matrix, MatrixSize = n)
-**    RowWidthA = Number of elements in memory between A[x,y] and A[x,y+1]
-**    RowWidthB = Number of elements in memory between B[x,y] and B[x,y+1]
-**    RowWidthC = Number of elements in memory between C[x,y] and C[x,y+1]
-**
-** OUTPUT:
-**    C = (*C WRITE) Matrix C contains A x B. (Initial value of *C undefined.)
-**
-*****************************************************************************/
-void FastNaiveMatrixMultiply(REAL *C, REAL *A, REAL *B, unsigned MatrixSize,
-                             unsigned RowWidthC, unsigned RowWidthA,
-                             unsigned RowWidthB) {
-
-  /* Assumes size of real is 8 bytes */
-  PTR RowWidthBInBytes = RowWidthB << 3;
-  PTR RowWidthAInBytes = RowWidthA << 3;
-  PTR MatrixWidthInBytes = MatrixSize << 3;
-  PTR RowIncrementC = (RowWidthC - MatrixSize) << 3;
-  unsigned Horizontal, Vertical;
-#ifdef DEBUG_ON
-  REAL *OLDC = C;
-  REAL *TEMPMATRIX;
-#endif
-
-  REAL *ARowStart = A;
-  for (Vertical = 0; Vertical < MatrixSize; Vertical++) {
-    for (Horizontal = 0; Horizontal < MatrixSize; Horizontal += 8) {
-      REAL *BColumnStart = B + Horizontal;
-      REAL FirstARowValue = *ARowStart++;
-
-      REAL Sum0 = FirstARowValue * (*BColumnStart);
-      REAL Sum1 = FirstARowValue * (*(BColumnStart + 1));
-      REAL Sum2 = FirstARowValue * (*(BColumnStart + 2));
-      REAL Sum3 = FirstARowValue * (*(BColumnStart + 3));
-      REAL Sum4 = FirstARowValue * (*(BColumnStart + 4));
-      REAL Sum5 = FirstARowValue * (*(BColumnStart + 5));
-      REAL Sum6 = FirstARowValue * (*(BColumnStart + 6));
-      REAL Sum7 = FirstARowValue * (*(BColumnStart + 7));
-
-      unsigned Products;
-      for (Products = 1; Products < MatrixSize; Products++) {
-        REAL ARowValue = *ARowStart++;
-        BColumnStart = (REAL *)(((PTR)BColumnStart) + RowWidthBInBytes);
-
-        Sum0 += ARowValue * (*BColumnStart);
-        Sum1 += ARowValue * (*(BColumnStart + 1));
-        Sum2 += ARowValue * (*(BColumnStart + 2));
-        Sum3 += ARowValue * (*(BColumnStart + 3));
-        Sum4 += ARowValue * (*(BColumnStart + 4));
-        Sum5 += ARowValue * (*(BColumnStart + 5));
-        Sum6 += ARowValue * (*(BColumnStart + 6));
-        Sum7 += ARowValue * (*(BColumnStart + 7));
-      }
-      ARowStart = (REAL *)(((PTR)ARowStart) - MatrixWidthInBytes);
-
-      *(C) = Sum0;
-      *(C + 1) = Sum1;
-      *(C + 2) = Sum2;
-      *(C + 3) = Sum3;
-      *(C + 4) = Sum4;
-      *(C + 5) = Sum5;
-      *(C + 6) = Sum6;
-      *(C + 7) = Sum7;
-      C += 8;
+/*
+ * C = A x B, or C += A x B if add is set, for m x k A and k x n B whose
+ * rows are an, bn and cn elements apart.  The kernel accumulates each row
+ * of C as a sum of rows of B.
+ */
+static void naive_kernel(REAL *restrict C, const REAL *restrict A,
+                         const REAL *restrict B, unsigned m, unsigned k,
+                         unsigned n, unsigned cn, unsigned an, unsigned bn,
+                         int add) {
+
+  for (unsigned i = 0; i < m; i++) {
+    REAL *restrict c = C + (size_t)i * cn;
+    if (!add)
+      for (unsigned j = 0; j < n; j++)
+        c[j] = 0.0;
+    for (unsigned l = 0; l < k; l++) {
+      REAL a = ELEM(A, an, i, l);
+      const REAL *restrict b = B + (size_t)l * bn;
+      for (unsigned j = 0; j < n; j++)
+        c[j] += a * b[j];
     }
-
-    ARowStart = (REAL *)(((PTR)ARowStart) + RowWidthAInBytes);
-    C = (REAL *)(((PTR)C) + RowIncrementC);
   }
 }
 
 /*****************************************************************************
  **
- ** FastAdditiveNaiveMatrixMultiply
- **
- ** For small to medium sized matrices A, B, and C of size
- ** MatrixSize * MatrixSize this function performs the operation
- ** C += A x B efficiently.
+ ** ClassicalMultiply
  **
- ** Note MatrixSize must be divisible by 8.
+ ** For matrices A (m x k), B (k x n) and C (m x n) of any shape this
+ ** function performs the operation
+ **    C  = A x B (if AdditiveMode == 0)
+ **    C += A x B (if AdditiveMode != 0)
+ ** by the cache-oblivious recursion: it halves the largest dimension,
+ ** in parallel for m and n and one half after the other for k, down to
+ ** blocks of about SizeAtWhichNaiveAlgorithmIsMoreEfficient on a side.
  **
  ** INPUT:
  **    C = (*C READ/WRITE) Address of top left element of matrix C.
  **    A = (*A IS READ ONLY) Address of top left element of matrix A.
  **    B = (*B IS READ ONLY) Address of top left element of matrix B.
- **    MatrixSize = Size of matrices (for n*n matrix, MatrixSize = n)
+ **    m, k, n = Dimensions of the product
  **    RowWidthA = Number of elements in memory between A[x,y] and A[x,y+1]
  **    RowWidthB = Number of elements in memory between B[x,y] and B[x,y+1]
  **    RowWidthC = Number of elements in memory between C[x,y] and C[x,y+1]
+ **    AdditiveMode = 0 if we want C = A x B, otherwise we'll do C += A x B
  **
  ** OUTPUT:
- **    C = (*C READ/WRITE) Matrix C contains C + A x B.
+ **    C (+)= A x B. (+ if AdditiveMode != 0)
  **
  *****************************************************************************/
-void FastAdditiveNaiveMatrixMultiply(REAL *C, REAL *A, REAL *B,
-                                     unsigned MatrixSize, unsigned RowWidthC,
-                                     unsigned RowWidthA, unsigned RowWidthB) {
-
-  /* Assumes size of real is 8 bytes */
-  PTR RowWidthBInBytes = RowWidthB << 3;
-  PTR RowWidthAInBytes = RowWidthA << 3;
-  PTR MatrixWidthInBytes = MatrixSize << 3;
-  PTR RowIncrementC = (RowWidthC - MatrixSize) << 3;
-
-  REAL *ARowStart = A;
-  for (unsigned Vertical = 0; Vertical < MatrixSize; Vertical++) {
-    for (unsigned Horizontal = 0; Horizontal < MatrixSize; Horizontal += 8) {
-      REAL *BColumnStart = B + Horizontal;
-
-      REAL Sum0 = *C;
-      REAL Sum1 = *(C + 1);
-      REAL Sum2 = *(C + 2);
-      REAL Sum3 = *(C + 3);
-      REAL Sum4 = *(C + 4);
-      REAL Sum5 = *(C + 5);
-      REAL Sum6 = *(C + 6);
-      REAL Sum7 = *(C + 7);
-
-      unsigned Products;
-      for (Products = 0; Products < MatrixSize; Products++) {
-        REAL ARowValue = *ARowStart++;
-
-        Sum0 += ARowValue * (*BColumnStart);
-        Sum1 += ARowValue * (*(BColumnStart + 1));
-        Sum2 += ARowValue * (*(BColumnStart + 2));
-        Sum3 += ARowValue * (*(BColumnStart + 3));
-        Sum4 += ARowValue * (*(BColumnStart + 4));
-        Sum5 += ARowValue * (*(BColumnStart + 5));
-        Sum6 += ARowValue * (*(BColumnStart + 6));
-        Sum7 += ARowValue * (*(BColumnStart + 7));
-
-        BColumnStart = (REAL *)(((PTR)BColumnStart) + RowWidthBInBytes);
-      }
-      ARowStart = (REAL *)(((PTR)ARowStart) - MatrixWidthInBytes);
-
-      *(C) = Sum0;
-      *(C + 1) = Sum1;
-      *(C + 2) = Sum2;
-      *(C + 3) = Sum3;
-      *(C + 4) = Sum4;
-      *(C + 5) = Sum5;
-      *(C + 6) = Sum6;
-      *(C + 7) = Sum7;
-      C += 8;
+void ClassicalMultiply(REAL *C, REAL *A, REAL *B, unsigned m, unsigned k,
+                       unsigned n, unsigned RowWidthC, unsigned RowWidthA,
+                       unsigned RowWidthB, int AdditiveMode) {
+
+  if (m <= SizeAtWhichNaiveAlgorithmIsMoreEfficient &&
+      k <= SizeAtWhichNaiveAlgorithmIsMoreEfficient &&
+      n <= 2 * SizeAtWhichNaiveAlgorithmIsMoreEfficient) {
+    naive_kernel(C, A, B, m, k, n, RowWidthC, RowWidthA, RowWidthB,
+                 AdditiveMode);
+    return;
+  }
+
+  if (m >= k && 2 * m >= n) {
+    unsigned m1 = m >> 1;
+    cilk_scope {
+      cilk_spawn ClassicalMultiply(C, A, B, m1, k, n, RowWidthC, RowWidthA,
+                                   RowWidthB, AdditiveMode);
+      ClassicalMultiply(C + m1 * RowWidthC, A + m1 * RowWidthA, B, m - m1, k,
+                        n, RowWidthC, RowWidthA, RowWidthB, AdditiveMode);
+    }
+  } else if (n >= 2 * k) {
+    unsigned n1 = n >> 1;
+    cilk_scope {
+      cilk_spawn ClassicalMultiply(C, A, B, m, k, n1, RowWidthC, RowWidthA,
+                                   RowWidthB, AdditiveMode);
+      ClassicalMultiply(C + n1, A, B + n1, m, k, n - n1, RowWidthC, RowWidthA,
+                        RowWidthB, AdditiveMode);
     }
+  } else {
+    unsigned k1 = k >> 1;
+    ClassicalMultiply(C, A, B, m, k1, n, RowWidthC, RowWidthA, RowWidthB,
+                      AdditiveMode);
+    ClassicalMultiply(C, A + k1, B + k1 * RowWidthB, m, k - k1, n, RowWidthC,
+                      RowWidthA, RowWidthB, 1);
+  }
+}
+
+/*
+ * Z = X + Y and Z = X - Y for m x n matrices whose rows are xn, yn and zn
+ * elements apart.  Z may be X or Y.  These O(n^2) passes are bound by
+ * memory bandwidth at large sizes, so the rows go in parallel, and each
+ * is a unit-stride loop the compiler vectorizes.
+ */
+void matrix_add(unsigned m, unsigned n, REAL *X, unsigned xn, REAL *Y,
+                unsigned yn, REAL *Z, unsigned zn) {
+
+  cilk_for (unsigned i = 0; i < m; i++) {
+    const REAL *x = X + (size_t)i * xn, *y = Y + (size_t)i * yn;
+    REAL *z = Z + (size_t)i * zn;
+    for (unsigned j = 0; j < n; j++)
+      z[j] = x[j] + y[j];
+  }
+}
+
+void matrix_sub(unsigned m, unsigned n, REAL *X, unsigned xn, REAL *Y,
+                unsigned yn, REAL *Z, unsigned zn) {
+
+  cilk_for (unsigned i = 0; i < m; i++) {
+    const REAL *x = X + (size_t)i * xn, *y = Y + (size_t)i * yn;
+    REAL *z = Z + (size_t)i * zn;
+    for (unsigned j = 0; j < n; j++)
+      z[j] = x[j] - y[j];
+  }
+}
+
+/*
+ * The additions of OptimizedStrassenMultiply, a row of n elements of each
+ * quadrant at a time.  pre_add_A computes
+ *    S1 = A21 + A22, S2 = S1 - A11, S3 = A11 - A21, S4 = A12 - S2
+ * and pre_add_B
+ *    S5 = B12 - B11, S6 = B22 - S5, S7 = B22 - B12, S8 = S6 - B21
+ * reading each input once.  post_add forms C from the products
+ *    M2 = A11 x B11, M5 = S1 x S5, T1 = S2 x S6, C22 = S3 x S7,
+ *    C11 = A12 x B21, C12 = S4 x B22 and C21 = A22 x S8.
+ */
+static void pre_add_A(unsigned n, const REAL *restrict a11,
+                      const REAL *restrict a12, const REAL *restrict a21,
+                      const REAL *restrict a22, REAL *restrict s1,
+                      REAL *restrict s2, REAL *restrict s3,
+                      REAL *restrict s4) {
+
+  for (unsigned j = 0; j < n; j++) {
+    REAL t1 = a21[j] + a22[j], t2 = t1 - a11[j];
+    s1[j] = t1;
+    s2[j] = t2;
+    s3[j] = a11[j] - a21[j];
+    s4[j] = a12[j] - t2;
+  }
+}
 
-    ARowStart = (REAL *)(((PTR)ARowStart) + RowWidthAInBytes);
-    C = (REAL *)(((PTR)C) + RowIncrementC);
+static void pre_add_B(unsigned n, const REAL *restrict b11,
+                      const REAL *restrict b12, const REAL *restrict b21,
+                      const REAL *restrict b22, REAL *restrict s5,
+                      REAL *restrict s6, REAL *restrict s7,
+                      REAL *restrict s8) {
+
+  for (unsigned j = 0; j < n; j++) {
+    REAL t5 = b12[j] - b11[j], t6 = b22[j] - t5;
+    s5[j] = t5;
+    s6[j] = t6;
+    s7[j] = b22[j] - b12[j];
+    s8[j] = t6 - b21[j];
   }
 }
 
+static void post_add(unsigned n, const REAL *restrict m2,
+                     const REAL *restrict m5, const REAL *restrict t1,
+                     REAL *restrict c11, REAL *restrict c12,
+                     REAL *restrict c21, REAL *restrict c22) {
+
+  for (unsigned j = 0; j < n; j++) {
+    REAL T1 = t1[j] + m2[j];
+    REAL T2 = c22[j] + T1;
+    c11[j] += m2[j];
+    c12[j] += m5[j] + T1;
+    c22[j] = m5[j] + T2;
+    c21[j] = T2 - c21[j];
+  }
+}
+
+void StrassenMultiply(REAL *C, REAL *A, REAL *B, unsigned m, unsigned k,
+                      unsigned n, unsigned RowWidthC, unsigned RowWidthA,
+                      unsigned RowWidthB, REAL *Work, int Depth);
+
 /*****************************************************************************
  **
- ** MultiplyByDivideAndConquer
+ ** StrassenWinogradMultiply
  **
- ** For medium to medium-large (would you like fries with that) sized
- ** matrices A, B, and C of size MatrixSize * MatrixSize this function
- ** efficiently performs the operation
- **    C  = A x B (if AdditiveMode == 0)
- **    C += A x B (if AdditiveMode != 0)
+ ** Performs C = A x B with the same seven products and fifteen additions
+ ** as OptimizedStrassenMultiply, but one product after the other, in the
+ ** order used by GEMMW (Douglas, Heroux, Slishman and Smith, J. Comp.
+ ** Physics, 1994).  C holds the intermediate sums, so each level needs only
+ ** two temporaries: X, which holds a quadrant of A and then one of C, and
+ ** Y, which holds a quadrant of B:
  **
- ** Note MatrixSize must be divisible by 16.
+ **    X = A11 - A21          Y = B22 - B12          C21 = X x Y
+ **    X = A21 + A22          Y = B12 - B11          C22 = X x Y
+ **    X = X - A11            Y = B22 - Y            C12 = X x Y
+ **    X = A12 - X                                   C11 = X x B22
+ **    X = A11 x B11
+ **    C12 = X + C12          C21 = C12 + C21        C12 = C12 + C22
+ **    C22 = C21 + C22        C12 = C12 + C11
+ **    Y = Y - B21            C11 = A22 x Y          C21 = C21 - C11
+ **    C11 = A12 x B21        C11 = X + C11
  **
  ** INPUT:
- **    C = (*C READ/WRITE) Address of top left element of matrix C.
- **    A = (*A IS READ ONLY) Address of top left element of matrix A.
- **    B = (*B IS READ ONLY) Address of top left element of matrix B.
- **    MatrixSize = Size of matrices (for n*n matrix, MatrixSize = n)
- **    RowWidthA = Number of elements in memory between A[x,y] and A[x,y+1]
- **    RowWidthB = Number of elements in memory between B[x,y] and B[x,y+1]
- **    RowWidthC = Number of elements in memory between C[x,y] and C[x,y+1]
- **    AdditiveMode = 0 if we want C = A x B, otherwise we'll do C += A x B
+ **    as for OptimizedStrassenMultiply, with Depth = 0.
  **
  ** OUTPUT:
- **    C (+)= A x B. (+ if AdditiveMode != 0)
+ **    C = (*C WRITE) Matrix C contains A x B. (Initial value of *C undefined.)
  **
  *****************************************************************************/
-void MultiplyByDivideAndConquer(REAL *C, REAL *A, REAL *B, unsigned MatrixSize,
-                                unsigned RowWidthC, unsigned RowWidthA,
-                                unsigned RowWidthB, int AdditiveMode) {
-
-#define A00 A
-#define B00 B
-#define C00 C
-
-  unsigned QuadrantSize = MatrixSize >> 1;
-
-  /* partition the matrix */
-  REAL *A01 = A00 + QuadrantSize;
-  REAL *A10 = A00 + RowWidthA * QuadrantSize;
-  REAL *A11 = A10 + QuadrantSize;
-
-  REAL *B01 = B00 + QuadrantSize;
-  REAL *B10 = B00 + RowWidthB * QuadrantSize;
-  REAL *B11 = B10 + QuadrantSize;
-
-  REAL *C01 = C00 + QuadrantSize;
-  REAL *C10 = C00 + RowWidthC * QuadrantSize;
-  REAL *C11 = C10 + QuadrantSize;
-
-  if (QuadrantSize > SizeAtWhichNaiveAlgorithmIsMoreEfficient) {
-
-    MultiplyByDivideAndConquer(C00, A00, B00, QuadrantSize, RowWidthC,
-                               RowWidthA, RowWidthB, AdditiveMode);
-
-    MultiplyByDivideAndConquer(C01, A00, B01, QuadrantSize, RowWidthC,
-                               RowWidthA, RowWidthB, AdditiveMode);
-
-    MultiplyByDivideAndConquer(C11, A10, B01, QuadrantSize, RowWidthC,
-                               RowWidthA, RowWidthB, AdditiveMode);
-
-    MultiplyByDivideAndConquer(C10, A10, B00, QuadrantSize, RowWidthC,
-                               RowWidthA, RowWidthB, AdditiveMode);
-
-    MultiplyByDivideAndConquer(C00, A01, B10, QuadrantSize, RowWidthC,
-                               RowWidthA, RowWidthB, 1);
-
-    MultiplyByDivideAndConquer(C01, A01, B11, QuadrantSize, RowWidthC,
-                               RowWidthA, RowWidthB, 1);
-
-    MultiplyByDivideAndConquer(C11, A11, B11, QuadrantSize, RowWidthC,
-                               RowWidthA, RowWidthB, 1);
-
-    MultiplyByDivideAndConquer(C10, A11, B10, QuadrantSize, RowWidthC,
-                               RowWidthA, RowWidthB, 1);
-
-  } else {
-
-    if (AdditiveMode) {
-      FastAdditiveNaiveMatrixMultiply(C00, A00, B00, QuadrantSize, RowWidthC,
-                                      RowWidthA, RowWidthB);
-
-      FastAdditiveNaiveMatrixMultiply(C01, A00, B01, QuadrantSize, RowWidthC,
-                                      RowWidthA, RowWidthB);
-
-      FastAdditiveNaiveMatrixMultiply(C11, A10, B01, QuadrantSize, RowWidthC,
-                                      RowWidthA, RowWidthB);
-
-      FastAdditiveNaiveMatrixMultiply(C10, A10, B00, QuadrantSize, RowWidthC,
-                                      RowWidthA, RowWidthB);
-
-    } else {
-
-      FastNaiveMatrixMultiply(C00, A00, B00, QuadrantSize, RowWidthC, RowWidthA,
-                              RowWidthB);
-
-      FastNaiveMatrixMultiply(C01, A00, B01, QuadrantSize, RowWidthC, RowWidthA,
-                              RowWidthB);
-
-      FastNaiveMatrixMultiply(C11, A10, B01, QuadrantSize, RowWidthC, RowWidthA,
-                              RowWidthB);
-
-      FastNaiveMatrixMultiply(C10, A10, B00, QuadrantSize, RowWidthC, RowWidthA,
-                              RowWidthB);
-    }
-
-    FastAdditiveNaiveMatrixMultiply(C00, A01, B10, QuadrantSize, RowWidthC,
-                                    RowWidthA, RowWidthB);
-
-    FastAdditiveNaiveMatrixMultiply(C01, A01, B11, QuadrantSize, RowWidthC,
-                                    RowWidthA, RowWidthB);
-
-    FastAdditiveNaiveMatrixMultiply(C11, A11, B11, QuadrantSize, RowWidthC,
-                                    RowWidthA, RowWidthB);
-
-    FastAdditiveNaiveMatrixMultiply(C10, A11, B10, QuadrantSize, RowWidthC,
-                                    RowWidthA, RowWidthB);
-  }
-
-  return;
+void StrassenWinogradMultiply(REAL *C, REAL *A, REAL *B, unsigned m,
+                              unsigned k, unsigned n, unsigned RowWidthC,
+                              unsigned RowWidthA, unsigned RowWidthB,
+                              REAL *Work) {
+
+  unsigned mq = m >> 1, kq = k >> 1, nq = n >> 1;
+  size_t XElements = (size_t)mq * (kq > nq ? kq : nq);
+
+  REAL *A12 = A + kq, *A21 = A + RowWidthA * mq, *A22 = A21 + kq;
+  REAL *B12 = B + nq, *B21 = B + RowWidthB * kq, *B22 = B21 + nq;
+  REAL *C12 = C + nq, *C21 = C + RowWidthC * mq, *C22 = C21 + nq;
+  REAL *X = Work, *Y = X + XElements, *W = Y + (size_t)kq * nq;
+
+  matrix_sub(mq, kq, A, RowWidthA, A21, RowWidthA, X, kq);
+  matrix_sub(kq, nq, B22, RowWidthB, B12, RowWidthB, Y, nq);
+  StrassenMultiply(C21, X, Y, mq, kq, nq, RowWidthC, kq, nq, W, 0);
+  matrix_add(mq, kq, A21, RowWidthA, A22, RowWidthA, X, kq);
+  matrix_sub(kq, nq, B12, RowWidthB, B, RowWidthB, Y, nq);
+  StrassenMultiply(C22, X, Y, mq, kq, nq, RowWidthC, kq, nq, W, 0);
+  matrix_sub(mq, kq, X, kq, A, RowWidthA, X, kq);
+  matrix_sub(kq, nq, B22, RowWidthB, Y, nq, Y, nq);
+  StrassenMultiply(C12, X, Y, mq, kq, nq, RowWidthC, kq, nq, W, 0);
+  matrix_sub(mq, kq, A12, RowWidthA, X, kq, X, kq);
+  StrassenMultiply(C, X, B22, mq, kq, nq, RowWidthC, kq, RowWidthB, W, 0);
+  StrassenMultiply(X, A, B, mq, kq, nq, nq, RowWidthA, RowWidthB, W, 0);
+  matrix_add(mq, nq, X, nq, C12, RowWidthC, C12, RowWidthC);
+  matrix_add(mq, nq, C12, RowWidthC, C21, RowWidthC, C21, RowWidthC);
+  matrix_add(mq, nq, C12, RowWidthC, C22, RowWidthC, C12, RowWidthC);
+  matrix_add(mq, nq, C21, RowWidthC, C22, RowWidthC, C22, RowWidthC);
+  matrix_add(mq, nq, C12, RowWidthC, C, RowWidthC, C12, RowWidthC);
+  matrix_sub(kq, nq, Y, nq, B21, RowWidthB, Y, nq);
+  StrassenMultiply(C, A22, Y, mq, kq, nq, RowWidthC, RowWidthA, nq, W, 0);
+  matrix_sub(mq, nq, C21, RowWidthC, C, RowWidthC, C21, RowWidthC);
+  StrassenMultiply(C, A12, B21, mq, kq, nq, RowWidthC, RowWidthA, RowWidthB,
+                   W, 0);
+  matrix_add(mq, nq, X, nq, C, RowWidthC, C, RowWidthC);
 }
 
 /*****************************************************************************
  **
  ** OptimizedStrassenMultiply
  **
- ** For large matrices A, B, and C of size MatrixSize * MatrixSize this
- ** function performs the operation C = A x B efficiently.
+ ** For large matrices A (m x k), B (k x n), and C (m x n), with m, k and
+ ** n even, this function performs the operation C = A x B efficiently.
+ ** The first Depth levels of the recursion compute their seven products
+ ** in parallel, each in its own part of Work; below them the products
+ ** run one after the other in StrassenWinogradMultiply, which needs far
+ ** less scratch space.
  **
  ** INPUT:
  **    C = (*C WRITE) Address of top left element of matrix C.
  **    A = (*A IS READ ONLY) Address of top left element of matrix A.
  **    B = (*B IS READ ONLY) Address of top left element of matrix B.
- **    MatrixSize = Size of matrices (for n*n matrix, MatrixSize = n)
+ **    m, k, n = Dimensions of the product
  **    RowWidthA = Number of elements in memory between A[x,y] and A[x,y+1]
  **    RowWidthB = Number of elements in memory between B[x,y] and B[x,y+1]
  **    RowWidthC = Number of elements in memory between C[x,y] and C[x,y+1]
+ **    Work = strassen_workspace(m, k, n, Depth) elements of scratch space
+ **    Depth = Number of levels whose products run in parallel
  **
  ** OUTPUT:
  **    C = (*C WRITE) Matrix C contains A x B. (Initial value of *C undefined.)
  **
  *****************************************************************************/
 
-#define strassen(n, A, an, B, bn, C, cn)                                       \
-  OptimizedStrassenMultiply(C, A, B, n, cn, bn, an)
-void OptimizedStrassenMultiply(REAL *C, REAL *A, REAL *B, unsigned MatrixSize,
-                               unsigned RowWidthC, unsigned RowWidthA,
-                               unsigned RowWidthB) {
+size_t strassen_workspace(unsigned m, unsigned k, unsigned n, int Depth);
 
-  unsigned QuadrantSize = MatrixSize >> 1; /* MatixSize / 2 */
-  unsigned QuadrantSizeInBytes =
-      sizeof(REAL) * QuadrantSize * QuadrantSize + 32;
+void OptimizedStrassenMultiply(REAL *C, REAL *A, REAL *B, unsigned m,
+                               unsigned k, unsigned n, unsigned RowWidthC,
+                               unsigned RowWidthA, unsigned RowWidthB,
+                               REAL *Work, int Depth) {
+
+  /* the dimensions of the quadrants */
+  unsigned QuadrantM = m >> 1, QuadrantK = k >> 1, QuadrantN = n >> 1;
+  size_t QuadrantElementsA = (size_t)QuadrantM * QuadrantK;
+  size_t QuadrantElementsB = (size_t)QuadrantK * QuadrantN;
+  size_t QuadrantElementsC = (size_t)QuadrantM * QuadrantN;
 
   /************************************************************************
    ** For each matrix A, B, and C, we'll want pointers to each quandrant
@@ -458,23 +422,10 @@ void OptimizedStrassenMultiply(REAL *C, REAL *A, REAL *B, unsigned MatrixSize,
    ************************************************************************/
 
 #define T2sMULT C22
-#define NumberOfVariables 11
-
-  PTR TempMatrixOffset = 0;
-  PTR MatrixOffsetA = 0;
-  PTR MatrixOffsetB = 0;
-
-  /* Distance between the end of a matrix row and the start of the next row */
-  PTR RowIncrementA = (RowWidthA - QuadrantSize) << 3;
-  PTR RowIncrementB = (RowWidthB - QuadrantSize) << 3;
-  PTR RowIncrementC = (RowWidthC - QuadrantSize) << 3;
-
-  char *Heap;
-  void *StartHeap;
 
-  if (MatrixSize <= SizeAtWhichDivideAndConquerIsMoreEfficient) {
-    MultiplyByDivideAndConquer(C, A, B, MatrixSize, RowWidthC, RowWidthA,
-                               RowWidthB, 0);
+  if (Depth == 0) {
+    StrassenWinogradMultiply(C, A, B, m, k, n, RowWidthC, RowWidthA,
+                             RowWidthB, Work);
 
     return;
   }
@@ -484,189 +435,199 @@ void OptimizedStrassenMultiply(REAL *C, REAL *A, REAL *B, unsigned MatrixSize,
 #define B11 B
 #define C11 C
 
-  REAL *A12 = A11 + QuadrantSize;
-  REAL *B12 = B11 + QuadrantSize;
-  REAL *C12 = C11 + QuadrantSize;
-  REAL *A21 = A + (RowWidthA * QuadrantSize);
-  REAL *B21 = B + (RowWidthB * QuadrantSize);
-  REAL *C21 = C + (RowWidthC * QuadrantSize);
-  REAL *A22 = A21 + QuadrantSize;
-  REAL *B22 = B21 + QuadrantSize;
-  REAL *C22 = C21 + QuadrantSize;
-
-  /* Allocate Heap Space Here */
-  char *_tmp = (char *)malloc(QuadrantSizeInBytes * NumberOfVariables);
-  StartHeap = Heap = _tmp;
-  /* ensure that heap is on cache boundary */
-  if (((PTR)Heap) & 31)
-    Heap = (char *)(((PTR)Heap) + 32 - (((PTR)Heap) & 31));
-
-  /* Distribute the heap space over the variables */
-  REAL *S1 = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-  REAL *S2 = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-  REAL *S3 = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-  REAL *S4 = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-  REAL *S5 = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-  REAL *S6 = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-  REAL *S7 = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-  REAL *S8 = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-  REAL *M2 = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-  REAL *M5 = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-  REAL *T1sMULT = (REAL *)Heap;
-  Heap += QuadrantSizeInBytes;
-
-  /***************************************************************************
-   ** Step through all columns row by row (vertically)
-   ** (jumps in memory by RowWidth => bad locality)
-   ** (but we want the best locality on the innermost loop)
-   **************************************************************************/
-  for (unsigned Row = 0; Row < QuadrantSize; Row++) {
-
-    /*********************************************************************
-     ** Step through each row horizontally (addressing elements in
-     ** each column) (jumps linearly througn memory => good locality)
-     *********************************************************************/
-    for (unsigned Column = 0; Column < QuadrantSize; Column++) {
-
-      /***********************************************************
-       ** Within this loop, the following holds for MatrixOffset:
-       ** MatrixOffset = (Row * RowWidth) + Column
-       ** (note: that the unit of the offset is number of reals)
-       ***********************************************************/
-      /* Element of Global Matrix, such as A, B, C */
-#define E(Matrix) (*(REAL *)(((PTR)Matrix) + TempMatrixOffset))
-#define EA(Matrix) (*(REAL *)(((PTR)Matrix) + MatrixOffsetA))
-#define EB(Matrix) (*(REAL *)(((PTR)Matrix) + MatrixOffsetB))
-
-      /* FIXME - may pay to expand these out - got higher speed-ups below */
-      /* S4 = A12 - ( S2 = ( S1 = A21 + A22 ) - A11 ) */
-      E(S4) = EA(A12) - (E(S2) = (E(S1) = EA(A21) + EA(A22)) - EA(A11));
-
-      /* S8 = (S6 = B22 - ( S5 = B12 - B11 ) ) - B21 */
-      E(S8) = (E(S6) = EB(B22) - (E(S5) = EB(B12) - EB(B11))) - EB(B21);
-
-      /* S3 = A11 - A21 */
-      E(S3) = EA(A11) - EA(A21);
-
-      /* S7 = B22 - B12 */
-      E(S7) = EB(B22) - EB(B12);
-
-      TempMatrixOffset += sizeof(REAL);
-      MatrixOffsetA += sizeof(REAL);
-      MatrixOffsetB += sizeof(REAL);
-    } /* end row loop*/
-
-    MatrixOffsetA += RowIncrementA;
-    MatrixOffsetB += RowIncrementB;
-  } /* end column loop */
+  REAL *A12 = A11 + QuadrantK;
+  REAL *B12 = B11 + QuadrantN;
+  REAL *C12 = C11 + QuadrantN;
+  REAL *A21 = A + (RowWidthA * QuadrantM);
+  REAL *B21 = B + (RowWidthB * QuadrantK);
+  REAL *C21 = C + (RowWidthC * QuadrantM);
+  REAL *A22 = A21 + QuadrantK;
+  REAL *B22 = B21 + QuadrantN;
+  REAL *C22 = C21 + QuadrantN;
+
+  /* Distribute the workspace over the variables and the seven products */
+  REAL *S1 = Work;
+  REAL *S2 = S1 + QuadrantElementsA;
+  REAL *S3 = S2 + QuadrantElementsA;
+  REAL *S4 = S3 + QuadrantElementsA;
+  REAL *S5 = S4 + QuadrantElementsA;
+  REAL *S6 = S5 + QuadrantElementsB;
+  REAL *S7 = S6 + QuadrantElementsB;
+  REAL *S8 = S7 + QuadrantElementsB;
+  REAL *M2 = S8 + QuadrantElementsB;
+  REAL *M5 = M2 + QuadrantElementsC;
+  REAL *T1sMULT = M5 + QuadrantElementsC;
+  REAL *W = T1sMULT + QuadrantElementsC;
+  size_t WorkPerProduct =
+      strassen_workspace(QuadrantM, QuadrantK, QuadrantN, Depth - 1);
+
+  /*
+   * The eight sums, in one parallel pass over the rows of the quadrants
+   * of A and then of B
+   */
+  cilk_for (unsigned Row = 0; Row < QuadrantM + QuadrantK; Row++) {
+    if (Row < QuadrantM)
+      pre_add_A(QuadrantK, A11 + Row * RowWidthA, A12 + Row * RowWidthA,
+                A21 + Row * RowWidthA, A22 + Row * RowWidthA,
+                S1 + Row * QuadrantK, S2 + Row * QuadrantK,
+                S3 + Row * QuadrantK, S4 + Row * QuadrantK);
+    else
+      pre_add_B(QuadrantN, B11 + (Row - QuadrantM) * RowWidthB,
+                B12 + (Row - QuadrantM) * RowWidthB,
+                B21 + (Row - QuadrantM) * RowWidthB,
+                B22 + (Row - QuadrantM) * RowWidthB,
+                S5 + (Row - QuadrantM) * QuadrantN,
+                S6 + (Row - QuadrantM) * QuadrantN,
+                S7 + (Row - QuadrantM) * QuadrantN,
+                S8 + (Row - QuadrantM) * QuadrantN);
+  }
 
   cilk_scope {
     /* M2 = A11 x B11 */
-    cilk_spawn OptimizedStrassenMultiply(M2, A11, B11, QuadrantSize,
-                                         QuadrantSize, RowWidthA, RowWidthB);
+    cilk_spawn StrassenMultiply(M2, A11, B11, QuadrantM, QuadrantK, QuadrantN,
+                                QuadrantN, RowWidthA, RowWidthB, W,
+                                Depth - 1);
 
     /* M5 = S1 * S5 */
-    cilk_spawn OptimizedStrassenMultiply(M5, S1, S5, QuadrantSize, QuadrantSize,
-                                         QuadrantSize, QuadrantSize);
+    cilk_spawn StrassenMultiply(M5, S1, S5, QuadrantM, QuadrantK, QuadrantN,
+                                QuadrantN, QuadrantK, QuadrantN,
+                                W + WorkPerProduct, Depth - 1);
 
     /* Step 1 of T1 = S2 x S6 + M2 */
-    cilk_spawn OptimizedStrassenMultiply(T1sMULT, S2, S6, QuadrantSize,
-                                         QuadrantSize, QuadrantSize,
-                                         QuadrantSize);
+    cilk_spawn StrassenMultiply(T1sMULT, S2, S6, QuadrantM, QuadrantK,
+                                QuadrantN, QuadrantN, QuadrantK, QuadrantN,
+                                W + 2 * WorkPerProduct, Depth - 1);
 
     /* Step 1 of T2 = T1 + S3 x S7 */
-    cilk_spawn OptimizedStrassenMultiply(C22, S3, S7, QuadrantSize,
-                                         RowWidthC /*FIXME*/, QuadrantSize,
-                                         QuadrantSize);
+    cilk_spawn StrassenMultiply(C22, S3, S7, QuadrantM, QuadrantK, QuadrantN,
+                                RowWidthC, QuadrantK, QuadrantN,
+                                W + 3 * WorkPerProduct, Depth - 1);
 
     /* Step 1 of C11 = M2 + A12 * B21 */
-    cilk_spawn OptimizedStrassenMultiply(C11, A12, B21, QuadrantSize, RowWidthC,
-                                         RowWidthA, RowWidthB);
+    cilk_spawn StrassenMultiply(C11, A12, B21, QuadrantM, QuadrantK,
+                                QuadrantN, RowWidthC, RowWidthA, RowWidthB,
+                                W + 4 * WorkPerProduct, Depth - 1);
 
     /* Step 1 of C12 = S4 x B22 + T1 + M5 */
-    cilk_spawn OptimizedStrassenMultiply(C12, S4, B22, QuadrantSize, RowWidthC,
-                                         QuadrantSize, RowWidthB);
+    cilk_spawn StrassenMultiply(C12, S4, B22, QuadrantM, QuadrantK,
+                                QuadrantN, RowWidthC, QuadrantK, RowWidthB,
+                                W + 5 * WorkPerProduct, Depth - 1);
 
     /* Step 1 of C21 = T2 - A22 * S8 */
-    OptimizedStrassenMultiply(C21, A22, S8, QuadrantSize, RowWidthC, RowWidthA,
-                              QuadrantSize);
+    StrassenMultiply(C21, A22, S8, QuadrantM, QuadrantK, QuadrantN,
+                     RowWidthC, RowWidthA, QuadrantN, W + 6 * WorkPerProduct,
+                     Depth - 1);
 
     /**********************************************
      ** Synchronization Point
      **********************************************/
   }
 
-  /*************************************************************************
-   ** Step through all columns row by row (vertically)
-   ** (jumps in memory by RowWidth => bad locality)
-   ** (but we want the best locality on the innermost loop)
-   *************************************************************************/
-  for (unsigned Row = 0; Row < QuadrantSize; Row++) {
-
-    /*********************************************************************
-     ** Step through each row horizontally (addressing elements in
-     ** each column) (jumps linearly througn memory => good locality)
-     *********************************************************************/
-    for (unsigned Column = 0; Column < QuadrantSize; Column += 4) {
-      REAL LocalM5_0 = *(M5);
-      REAL LocalM5_1 = *(M5 + 1);
-      REAL LocalM5_2 = *(M5 + 2);
-      REAL LocalM5_3 = *(M5 + 3);
-      REAL LocalM2_0 = *(M2);
-      REAL LocalM2_1 = *(M2 + 1);
-      REAL LocalM2_2 = *(M2 + 2);
-      REAL LocalM2_3 = *(M2 + 3);
-      REAL T1_0 = *(T1sMULT) + LocalM2_0;
-      REAL T1_1 = *(T1sMULT + 1) + LocalM2_1;
-      REAL T1_2 = *(T1sMULT + 2) + LocalM2_2;
-      REAL T1_3 = *(T1sMULT + 3) + LocalM2_3;
-      REAL T2_0 = *(C22) + T1_0;
-      REAL T2_1 = *(C22 + 1) + T1_1;
-      REAL T2_2 = *(C22 + 2) + T1_2;
-      REAL T2_3 = *(C22 + 3) + T1_3;
-      (*(C11)) += LocalM2_0;
-      (*(C11 + 1)) += LocalM2_1;
-      (*(C11 + 2)) += LocalM2_2;
-      (*(C11 + 3)) += LocalM2_3;
-      (*(C12)) += LocalM5_0 + T1_0;
-      (*(C12 + 1)) += LocalM5_1 + T1_1;
-      (*(C12 + 2)) += LocalM5_2 + T1_2;
-      (*(C12 + 3)) += LocalM5_3 + T1_3;
-      (*(C22)) = LocalM5_0 + T2_0;
-      (*(C22 + 1)) = LocalM5_1 + T2_1;
-      (*(C22 + 2)) = LocalM5_2 + T2_2;
-      (*(C22 + 3)) = LocalM5_3 + T2_3;
-      (*(C21)) = (-*(C21)) + T2_0;
-      (*(C21 + 1)) = (-*(C21 + 1)) + T2_1;
-      (*(C21 + 2)) = (-*(C21 + 2)) + T2_2;
-      (*(C21 + 3)) = (-*(C21 + 3)) + T2_3;
-      M5 += 4;
-      M2 += 4;
-      T1sMULT += 4;
-      C11 += 4;
-      C12 += 4;
-      C21 += 4;
-      C22 += 4;
-    }
+  /* Combine the products into C, a row of each quadrant at a time */
+  cilk_for (unsigned Row = 0; Row < QuadrantM; Row++)
+    post_add(QuadrantN, M2 + Row * QuadrantN, M5 + Row * QuadrantN,
+             T1sMULT + Row * QuadrantN, C11 + Row * RowWidthC,
+             C12 + Row * RowWidthC, C21 + Row * RowWidthC,
+             T2sMULT + Row * RowWidthC);
+
+  return;
+}
+
+/*
+ * C = A x B for A (m x k), B (k x n) and C (m x n) of any shape, by
+ * Strassen's algorithm with dynamic peeling: when a dimension is odd, the
+ * last row of A and C, the last column of A and row of B, or the last
+ * column of B and C is left out of the recursion and added in by the
+ * classical multiply.  Products whose smallest dimension is at most
+ * strassen_crossover are classical altogether.
+ */
+int strassen_crossover = SizeAtWhichStrassenIsMoreEfficient;
+
+void StrassenMultiply(REAL *C, REAL *A, REAL *B, unsigned m, unsigned k,
+                      unsigned n, unsigned RowWidthC, unsigned RowWidthA,
+                      unsigned RowWidthB, REAL *Work, int Depth) {
 
-    C11 = (REAL *)(((PTR)C11) + RowIncrementC);
-    C12 = (REAL *)(((PTR)C12) + RowIncrementC);
-    C21 = (REAL *)(((PTR)C21) + RowIncrementC);
-    C22 = (REAL *)(((PTR)C22) + RowIncrementC);
+  unsigned me = m & ~1u, ke = k & ~1u, ne = n & ~1u;
+
+  if (m <= strassen_crossover || k <= strassen_crossover ||
+      n <= strassen_crossover) {
+    ClassicalMultiply(C, A, B, m, k, n, RowWidthC, RowWidthA, RowWidthB, 0);
+    return;
   }
-  free(StartHeap);
 
-  return;
+  cilk_scope {
+    /* the last column of C, and the rest of its last row */
+    if (n != ne)
+      cilk_spawn ClassicalMultiply(C + ne, A, B + ne, m, k, 1, RowWidthC,
+                                   RowWidthA, RowWidthB, 0);
+    if (m != me)
+      cilk_spawn ClassicalMultiply(C + me * RowWidthC, A + me * RowWidthA, B,
+                                   1, k, ne, RowWidthC, RowWidthA, RowWidthB,
+                                   0);
+
+    OptimizedStrassenMultiply(C, A, B, me, ke, ne, RowWidthC, RowWidthA,
+                              RowWidthB, Work, Depth);
+    /* the last column of A times the last row of B */
+    if (k != ke)
+      ClassicalMultiply(C, A + ke, B + ke * RowWidthB, me, 1, ne, RowWidthC,
+                        RowWidthA, RowWidthB, 1);
+  }
+}
+
+/*
+ * The scratch space, in elements, that StrassenMultiply needs for an
+ * m x k x n product whose first depth levels run in parallel: the
+ * temporaries of a level, and the space of its products, which is shared
+ * when they run one after the other.
+ */
+size_t strassen_workspace(unsigned m, unsigned k, unsigned n, int depth) {
+
+  size_t mq = m >> 1, kq = k >> 1, nq = n >> 1;
+
+  if (m <= strassen_crossover || k <= strassen_crossover ||
+      n <= strassen_crossover)
+    return 0;
+  if (depth == 0)
+    return mq * (kq > nq ? kq : nq) + kq * nq +
+           strassen_workspace(mq, kq, nq, 0);
+  return 4 * mq * kq + 4 * kq * nq + 3 * mq * nq +
+         7 * strassen_workspace(mq, kq, nq, depth - 1);
+}
+
+/*
+ * The number of levels whose products run in parallel: enough for
+ * STRASSEN_SLACK products per worker.  A single worker runs all of them
+ * one after the other, in the least space.
+ */
+#define STRASSEN_SLACK 4
+
+int strassen_depth(unsigned m, unsigned k, unsigned n) {
+
+  unsigned workers = __cilkrts_get_nworkers();
+  int depth = 0;
+
+  for (unsigned long products = 1;
+       workers > 1 && products < STRASSEN_SLACK * workers &&
+       m > strassen_crossover && k > strassen_crossover &&
+       n > strassen_crossover;
+       products *= 7, m >>= 1, k >>= 1, n >>= 1)
+    depth++;
+  return depth;
+}
+
+/*
+ * C = A x B for m x k A and k x n B whose rows are an, bn and cn elements
+ * apart.  The scratch space of the whole recursion is allocated once.
+ */
+void strassen(unsigned m, unsigned k, unsigned n, REAL *A, unsigned an,
+              REAL *B, unsigned bn, REAL *C, unsigned cn) {
+
+  int depth = strassen_depth(m, k, n);
+  REAL *Work =
+      (REAL *)malloc(strassen_workspace(m, k, n, depth) * sizeof(REAL));
+
+  StrassenMultiply(C, A, B, m, k, n, cn, an, bn, Work, depth);
+  free(Work);
 }
 
 /*
@@ -714,12 +675,12 @@ REAL *alloc_vec(int n) { return (REAL *)malloc(n * sizeof(REAL)); }
 void free_vec(REAL *V) { free(V); }
 
 /*
- * Set an n by n matrix A to random values.  The distance between
+ * Set an m by n matrix A to random values.  The distance between
  * rows is an
  */
-void init_matrix(int n, REAL *A, int an) {
+void init_matrix(int m, int n, REAL *A, int an) {
 
-  for (int i = 0; i < n; ++i)
+  for (int i = 0; i < m; ++i)
     for (int j = 0; j < n; ++j)
       ELEM(A, an, i, j) = ((double)cilk_rand()) / (double)RAND_MAX;
 }
@@ -728,9 +689,9 @@ void init_matrix(int n, REAL *A, int an) {
  * Compare two matrices.  Print an error message if they differ by
  * more than EPSILON.
  */
-int compare_matrix(int n, REAL *A, int an, REAL *B, int bn) {
+int compare_matrix(int m, int n, REAL *A, int an, REAL *B, int bn) {
 
-  for (int i = 0; i < n; ++i) {
+  for (int i = 0; i < m; ++i) {
     for (int j = 0; j < n; ++j) {
       /* compute the relative error c */
       REAL c = ELEM(A, an, i, j) - ELEM(B, bn, i, j);
@@ -748,9 +709,11 @@ int compare_matrix(int n, REAL *A, int an, REAL *B, int bn) {
 }
 
 /*
- * Allocate a matrix of side n (therefore n^2 elements)
+ * Allocate an m by n matrix
  */
-REAL *alloc_matrix(int n) { return (REAL *)malloc(n * n * sizeof(REAL)); }
+REAL *alloc_matrix(int m, int n) {
+  return (REAL *)malloc((size_t)m * n * sizeof(REAL));
+}
 
 /*
  * free a matrix (Never used because Matteo expects
@@ -763,16 +726,26 @@ void free_matrix(REAL *A) { free(A); }
  */
 int usage(void) {
   fprintf(stderr,
-          "\nUsage: strassen [<cilk-options>] [-n #] [-c] [-rc]\n\n"
-          "Multiplies two randomly generated n x n matrices. To check for\n"
-          "correctness use -c using iterative matrix multiply or use -rc \n"
-          "using randomized algorithm due to Freivalds.\n\n");
+          "\nUsage: strassen [<cilk-options>] [-n #] [-m #] [-k #] "
+          "[-crossover #] [-c] [-rc]\n\n"
+          "Multiplies two randomly generated matrices, m x k and k x n; m "
+          "and k default\n"
+          "to n. To check for correctness use -c using iterative matrix "
+          "multiply or use\n"
+          "-rc using randomized algorithm due to Freivalds.\n"
+          "Products whose smallest dimension is at most the crossover "
+          "(default %d)\n"
+          "use the classical recursive multiply; a crossover of n or more "
+          "times it alone.\n\n",
+          SizeAtWhichStrassenIsMoreEfficient);
 
   return 1;
 }
 
-const char *specifiers[] = {"-n", "-c", "-rc", "-benchmark", "-h", 0};
-int opt_types[] = {INTARG, BOOLARG, BOOLARG, BENCHMARK, BOOLARG, 0};
+const char *specifiers[] = {"-n", "-c", "-rc", "-benchmark", "-h",
+                            "-m", "-k", "-crossover", 0};
+int opt_types[] = {INTARG,  BOOLARG, BOOLARG, BENCHMARK, BOOLARG,
+                   INTARG, INTARG, INTARG, 0};
 
 int main(int argc, char *argv[]) {
 
@@ -780,11 +753,12 @@ int main(int argc, char *argv[]) {
 
   /* standard benchmark options*/
   int n = 512;
+  int m = 0, k = 0; /* default to n */
   int verify = 0;
   int rand_check = 0;
 
   get_options(argc, argv, specifiers, opt_types, &n, &verify, &rand_check,
-              &benchmark, &help);
+              &benchmark, &help, &m, &k, &strassen_crossover);
 
   if (help)
     return usage();
@@ -803,49 +777,54 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if ((n & (n - 1)) != 0 || (n % 16) != 0) {
-    printf("%d: matrix size must be a power of 2"
-           " and a multiple of %d\n",
-           n, 16);
+  if (m <= 0)
+    m = n;
+  if (k <= 0)
+    k = n;
+  if (n < 1 || strassen_crossover < 1) {
+    printf("matrix size and crossover must be positive\n");
     return 1;
   }
 
-  REAL *A = alloc_matrix(n);
-  REAL *B = alloc_matrix(n);
-  REAL *C = alloc_matrix(n);
+  REAL *A = alloc_matrix(m, k);
+  REAL *B = alloc_matrix(k, n);
+  REAL *C = alloc_matrix(m, n);
 
-  init_matrix(n, A, n);
-  init_matrix(n, B, n);
+  init_matrix(m, k, A, k);
+  init_matrix(k, n, B, n);
 
   struct timeval t1, t2;
   gettimeofday(&t1, 0);
 
-  strassen(n, A, n, B, n, C, n);
+  strassen(m, k, n, A, k, B, n, C, n);
 
   gettimeofday(&t2, 0);
-  unsigned long long runtime_ms = (todval(&t2) - todval(&t1)) / 1000;
-  printf("%f\n", runtime_ms / 1000.0);
+  unsigned long long runtime_us = todval(&t2) - todval(&t1);
+  printf("%f\n", runtime_us / 1e6);
 
   if (rand_check) {
-    REAL *R, *V1, *V2;
+    REAL *R, *V1, *V2, *V3;
     R = alloc_vec(n);
-    V1 = alloc_vec(n);
-    V2 = alloc_vec(n);
+    V1 = alloc_vec(k);
+    V2 = alloc_vec(m);
+    V3 = alloc_vec(m);
 
-    mat_vec_mul(n, n, n, B, R, V1, 0);
-    mat_vec_mul(n, n, n, A, V1, V2, 0);
-    mat_vec_mul(n, n, n, C, R, V1, 0);
-    rand_check = compare_vec(n, V1, V2);
+    init_vec(n, R);
+    mat_vec_mul(k, n, n, B, R, V1, 0);
+    mat_vec_mul(m, k, k, A, V1, V2, 0);
+    mat_vec_mul(m, n, n, C, R, V3, 0);
+    rand_check = compare_vec(m, V3, V2);
 
     free_vec(R);
     free_vec(V1);
     free_vec(V2);
+    free_vec(V3);
 
   } else if (verify) {
     fprintf(stderr, "Checking results ... \n");
-    REAL *C2 = alloc_matrix(n);
-    matrixmul(n, A, n, B, n, C2, n);
-    verify = compare_matrix(n, C, n, C2, n);
+    REAL *C2 = alloc_matrix(m, n);
+    matrixmul(m, k, n, A, k, B, n, C2, n);
+    verify = compare_matrix(m, n, C, n, C2, n);
     free_matrix(C2);
   }
 
@@ -854,7 +833,15 @@ int main(int argc, char *argv[]) {
 
   } else {
     fprintf(stderr, "\nCilk Example: strassen\n");
-    fprintf(stderr, "Options: n = %d\n\n", n);
+    fprintf(stderr, "Options: m = %d, k = %d, n = %d, crossover = %d\n", m, k,
+            n, strassen_crossover);
+    if (runtime_us > 0)
+      fprintf(stderr, "GFLOP/s (2mkn / time): %.2f\n",
+              2.0 * m * k * n / (runtime_us * 1e3));
+    fprintf(stderr, "Workspace: %.1f MB, %d parallel levels\n\n",
+            strassen_workspace(m, k, n, strassen_depth(m, k, n)) *
+                sizeof(REAL) / 1e6,
+            strassen_depth(m, k, n));
   }
 
   free_matrix(A);